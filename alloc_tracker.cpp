@@ -0,0 +1,70 @@
+// Replacement global operator new/delete for the allocation tracking build.
+// Linked only into the *-alloc binaries built by `make alloc-tracking`.
+
+#include <cstdlib>   // For std::malloc, std::aligned_alloc, std::free
+#include <cstddef>   // For std::max_align_t
+#include <new>
+#include "alloc_tracker.h"
+
+namespace {
+
+// Every block carries a header recording its size so frees can be accounted for
+// even when the caller uses unsized delete. The header is at least as large as
+// the alignment so the returned pointer keeps the requested alignment.
+void* trackedAlloc(std::size_t size, std::size_t alignment) noexcept {
+    std::size_t header = alignment > alignof(std::max_align_t) ? alignment : alignof(std::max_align_t);
+    void* raw;
+    if (alignment > alignof(std::max_align_t)) {
+        std::size_t total = (size + header + alignment - 1) / alignment * alignment;
+        raw = std::aligned_alloc(alignment, total);
+    } else {
+        raw = std::malloc(size + header);
+    }
+    if (!raw) {
+        return nullptr;
+    }
+    unsigned char* user = static_cast<unsigned char*>(raw) + header;
+    reinterpret_cast<std::size_t*>(user)[-1] = size;
+    alloc_tracking::recordAllocation(size);
+    return user;
+}
+
+void trackedFree(void* ptr, std::size_t alignment) noexcept {
+    if (!ptr) {
+        return;
+    }
+    std::size_t header = alignment > alignof(std::max_align_t) ? alignment : alignof(std::max_align_t);
+    unsigned char* user = static_cast<unsigned char*>(ptr);
+    alloc_tracking::recordFree(reinterpret_cast<std::size_t*>(user)[-1]);
+    std::free(user - header);
+}
+
+void* allocOrThrow(std::size_t size, std::size_t alignment) {
+    void* ptr = trackedAlloc(size ? size : 1, alignment);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+constexpr std::size_t DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+} // namespace
+
+void* operator new(std::size_t size) { return allocOrThrow(size, DEFAULT_ALIGNMENT); }
+void* operator new[](std::size_t size) { return allocOrThrow(size, DEFAULT_ALIGNMENT); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size ? size : 1, DEFAULT_ALIGNMENT); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size ? size : 1, DEFAULT_ALIGNMENT); }
+void* operator new(std::size_t size, std::align_val_t align) { return allocOrThrow(size, static_cast<std::size_t>(align)); }
+void* operator new[](std::size_t size, std::align_val_t align) { return allocOrThrow(size, static_cast<std::size_t>(align)); }
+
+void operator delete(void* ptr) noexcept { trackedFree(ptr, DEFAULT_ALIGNMENT); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr, DEFAULT_ALIGNMENT); }
+void operator delete(void* ptr, std::size_t) noexcept { trackedFree(ptr, DEFAULT_ALIGNMENT); }
+void operator delete[](void* ptr, std::size_t) noexcept { trackedFree(ptr, DEFAULT_ALIGNMENT); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr, DEFAULT_ALIGNMENT); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr, DEFAULT_ALIGNMENT); }
+void operator delete(void* ptr, std::align_val_t align) noexcept { trackedFree(ptr, static_cast<std::size_t>(align)); }
+void operator delete[](void* ptr, std::align_val_t align) noexcept { trackedFree(ptr, static_cast<std::size_t>(align)); }
+void operator delete(void* ptr, std::size_t, std::align_val_t align) noexcept { trackedFree(ptr, static_cast<std::size_t>(align)); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t align) noexcept { trackedFree(ptr, static_cast<std::size_t>(align)); }
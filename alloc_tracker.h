@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>        // For std::nothrow
+#include <sys/resource.h> // For getrusage
+
+// Heap allocation accounting for the instrumented build (make alloc-tracking).
+// alloc_tracker.cpp replaces the global operator new/delete and charges every
+// allocation to the calling thread's current phase. In the normal build operator
+// new is left alone and AllocPhaseScope compiles to nothing.
+
+namespace alloc_tracking {
+
+constexpr int MAX_PHASES = 8; // Phase 0 collects everything outside a named phase.
+
+struct PhaseCounters {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<long> peak_rss_kb{0}; // Process RSS high-water mark seen when the phase last ended.
+};
+
+inline PhaseCounters phase_counters[MAX_PHASES];
+inline std::atomic<uint64_t> live_bytes{0};
+inline std::atomic<uint64_t> peak_live_bytes{0};
+inline thread_local int current_phase = 0;
+
+constexpr bool enabled() {
+#ifdef MTC_ALLOC_TRACKING
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Process RSS high-water mark in KB.
+inline long peakRssKb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+inline void recordAllocation(uint64_t size) {
+    PhaseCounters& counters = phase_counters[current_phase];
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    counters.bytes.fetch_add(size, std::memory_order_relaxed);
+    uint64_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = peak_live_bytes.load(std::memory_order_relaxed);
+    while (live > peak && !peak_live_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+inline void recordFree(uint64_t size) {
+    live_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// zalloc/zfree hooks that route zlib's internal state through operator new,
+// so the tracking build also sees deflate and inflate allocations.
+inline void* zlibAlloc(void*, unsigned items, unsigned size) {
+    return ::operator new(static_cast<size_t>(items) * size, std::nothrow);
+}
+
+inline void zlibFree(void*, void* address) {
+    ::operator delete(address);
+}
+
+} // namespace alloc_tracking
+
+// Charges allocations made by the calling thread to `phase` for the lifetime of the scope.
+class AllocPhaseScope {
+public:
+#ifdef MTC_ALLOC_TRACKING
+    explicit AllocPhaseScope(int phase) : previous(alloc_tracking::current_phase) {
+        alloc_tracking::current_phase = phase;
+    }
+
+    ~AllocPhaseScope() {
+        std::atomic<long>& peak = alloc_tracking::phase_counters[alloc_tracking::current_phase].peak_rss_kb;
+        long rss = alloc_tracking::peakRssKb();
+        long seen = peak.load(std::memory_order_relaxed);
+        while (rss > seen && !peak.compare_exchange_weak(seen, rss, std::memory_order_relaxed)) {
+        }
+        alloc_tracking::current_phase = previous;
+    }
+
+private:
+    int previous;
+#else
+    explicit AllocPhaseScope(int) {}
+#endif
+};
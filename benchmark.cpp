@@ -0,0 +1,421 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cstdlib>    // For std::system, mkdtemp
+#include <cstdio>     // For popen
+#include <filesystem> // For temp_directory_path, file_size, remove_all
+#include "topology.h"
+
+// Benchmarks the compressor and decompressor binaries over a generated corpus,
+// sweeping thread counts, chunk sizes, levels and page backing. Results are printed
+// as a table and optionally written as JSON. Run it through `make bench` so the
+// binaries under test are up to date.
+
+namespace fs = std::filesystem;
+
+// Benchmark settings; every list is swept as one dimension of the matrix.
+struct BenchConfig {
+    size_t size_mb = 64;
+    int runs = 3;
+    std::vector<std::string> corpora = {"text", "logs", "random", "zeros", "binary"};
+    std::vector<size_t> threads;
+    std::vector<size_t> chunk_sizes = {1024 * 1024};
+    std::vector<int> levels = {6};
+    std::vector<std::string> pages = {"normal", "huge"};
+    std::string json_path;
+    bool perf_counters = false; // Collect IPC and cycles/byte from the tools' --stats output.
+    bool alloc_tracking = false; // Run the *-alloc builds and report heap allocations.
+    // Fail the run if compression makes more pipeline-phase allocations per chunk
+    // than this (one-time setup is excluded); negative disables the check.
+    double max_allocs_per_chunk = -1;
+};
+
+// A private directory for one run's corpus and outputs, so concurrent runs
+// don't overwrite each other's files. It is removed with everything in it;
+// `path` is empty if it could not be created.
+struct ScratchDir {
+    fs::path path;
+    ScratchDir() {
+        std::string name = (fs::temp_directory_path() / "mtc_bench_XXXXXX").string();
+        if (mkdtemp(name.data())) {
+            path = name;
+        }
+    }
+    ~ScratchDir() {
+        if (!path.empty()) {
+            std::error_code ec;
+            fs::remove_all(path, ec);
+        }
+    }
+    ScratchDir(const ScratchDir&) = delete;
+    ScratchDir& operator=(const ScratchDir&) = delete;
+};
+
+// One measured point of the matrix.
+struct BenchResult {
+    std::string corpus;
+    size_t chunk_size;
+    int level;
+    std::string pages;
+    size_t threads;
+    double compress_mbps;
+    double decompress_mbps;
+    double ratio;
+    double efficiency; // Speedup over the first thread count, divided by the thread ratio.
+    // Hardware counter results, with --perf-counters; zero when unavailable.
+    double compress_ipc = 0;
+    double compress_cycles_per_byte = 0;
+    double decompress_ipc = 0;
+    double decompress_cycles_per_byte = 0;
+    // Heap results, with --alloc-tracking.
+    double compress_allocs_per_chunk = 0;
+    double compress_peak_heap = 0;
+    double decompress_allocs_per_chunk = 0;
+};
+
+// Writes `size` bytes of the named kind of data. Every generator is seeded so runs are comparable.
+void generateCorpus(const std::string& kind, const fs::path& path, size_t size) {
+    static const char* words[] = {"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+                                  "chunk", "thread", "worker", "buffer", "compress", "stream"};
+    static const char* levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+    std::mt19937 rng(42);
+    std::ofstream out(path, std::ios::binary);
+    std::string block;
+    size_t written = 0;
+    size_t line = 0;
+    while (written < size) {
+        block.clear();
+        if (kind == "text") {
+            while (block.size() < 4096) {
+                block += words[rng() % (sizeof(words) / sizeof(words[0]))];
+                block += (rng() % 12 == 0) ? '\n' : ' ';
+            }
+        } else if (kind == "logs") {
+            while (block.size() < 4096) {
+                std::ostringstream entry;
+                entry << "2024-01-01T00:" << std::setw(2) << std::setfill('0') << (line / 60) % 60 << ':'
+                      << std::setw(2) << line % 60 << '.' << std::setw(3) << rng() % 1000 << ' '
+                      << levels[rng() % 4] << " worker-" << rng() % 16 << " processed chunk "
+                      << line << " in " << rng() % 500 << "us\n";
+                block += entry.str();
+                ++line;
+            }
+        } else if (kind == "random") {
+            for (int i = 0; i < 1024; ++i) {
+                uint32_t value = rng();
+                block.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            }
+        } else if (kind == "zeros") {
+            block.assign(4096, '\0');
+        } else { // "binary": fixed-layout records with small integers and floats
+            for (int i = 0; i < 128; ++i) {
+                uint64_t id = line++;
+                uint32_t count = rng() % 256;
+                float value = static_cast<float>(rng() % 10000) / 100.0f;
+                uint64_t flags = (rng() % 8 == 0) ? 1 : 0;
+                block.append(reinterpret_cast<const char*>(&id), sizeof(id));
+                block.append(reinterpret_cast<const char*>(&count), sizeof(count));
+                block.append(reinterpret_cast<const char*>(&value), sizeof(value));
+                block.append(reinterpret_cast<const char*>(&flags), sizeof(flags));
+            }
+        }
+        size_t n = std::min(block.size(), size - written);
+        out.write(block.data(), n);
+        written += n;
+    }
+}
+
+// Runs a command and returns the wall-clock time in seconds, or a negative value if
+// the command failed. Its stdout is captured into `output` if given, else discarded.
+double timeCommand(const std::string& command, std::string* output = nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    int status;
+    if (output) {
+        output->clear();
+        FILE* pipe = popen(command.c_str(), "r");
+        if (!pipe) {
+            return -1.0;
+        }
+        char buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+            output->append(buffer, n);
+        status = pclose(pipe);
+    } else {
+        status = std::system((command + " > /dev/null").c_str());
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (status != 0) {
+        return -1.0;
+    }
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Returns the fastest of `runs` executions, or a negative value if any run failed.
+// If `output` is given it receives the stdout of the fastest run.
+double bestTime(const std::string& command, int runs, std::string* output = nullptr) {
+    double best = -1.0;
+    std::string run_output;
+    for (int run = 0; run < runs; ++run) {
+        double seconds = timeCommand(command, output ? &run_output : nullptr);
+        if (seconds < 0) {
+            std::cerr << "Error: command failed: " << command << "\n";
+            return -1.0;
+        }
+        if (best < 0 || seconds < best) {
+            best = seconds;
+            if (output) *output = run_output;
+        }
+    }
+    return best;
+}
+
+// Extracts a numeric field from the tools' flat --stats=json output; 0 if absent.
+double jsonNumber(const std::string& json, const std::string& key) {
+    size_t pos = json.find("\"" + key + "\": ");
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    return std::strtod(json.c_str() + pos + key.size() + 4, nullptr);
+}
+
+// Splits a comma-separated list.
+std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "Options:\n"
+              << "  --size-mb N          Size of each generated corpus (default 64)\n"
+              << "  --runs N             Repetitions per point; the best time is kept (default 3)\n"
+              << "  --corpora LIST       Any of text,logs,random,zeros,binary (default all)\n"
+              << "  --threads LIST       Thread counts (default 1,2,4,... up to the usable CPUs)\n"
+              << "  --chunk-sizes LIST   Chunk sizes in bytes (default 1048576)\n"
+              << "  --levels LIST        zlib levels (default 6)\n"
+              << "  --pages LIST         normal,huge (default both)\n"
+              << "  --json FILE          Also write the results as JSON\n"
+              << "  --perf-counters      Also report IPC and cycles/byte from hardware counters\n"
+              << "  --alloc-tracking     Run the instrumented *-alloc builds and report heap allocations\n"
+              << "                       (throughput then includes the tracking overhead)\n"
+              << "  --max-allocs-per-chunk N\n"
+              << "                       With --alloc-tracking, exit with status 2 if compression\n"
+              << "                       allocates more than N times per chunk\n";
+}
+
+bool parseArgs(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--perf-counters" || arg == "--alloc-tracking") {
+            (arg == "--perf-counters" ? config.perf_counters : config.alloc_tracking) = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--size-mb") {
+                config.size_mb = std::stoul(value);
+            } else if (arg == "--runs") {
+                config.runs = std::stoi(value);
+            } else if (arg == "--corpora") {
+                config.corpora = splitList(value);
+            } else if (arg == "--threads") {
+                config.threads.clear();
+                for (const auto& item : splitList(value)) config.threads.push_back(std::stoul(item));
+            } else if (arg == "--chunk-sizes") {
+                config.chunk_sizes.clear();
+                for (const auto& item : splitList(value)) config.chunk_sizes.push_back(std::stoul(item));
+            } else if (arg == "--levels") {
+                config.levels.clear();
+                for (const auto& item : splitList(value)) config.levels.push_back(std::stoi(item));
+            } else if (arg == "--pages") {
+                config.pages = splitList(value);
+            } else if (arg == "--max-allocs-per-chunk") {
+                config.max_allocs_per_chunk = std::stod(value);
+            } else if (arg == "--json") {
+                config.json_path = value;
+            } else {
+                return false;
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    if (config.threads.empty()) {
+        size_t max_threads = defaultThreadCount(allowedCpus());
+        for (size_t t = 1; t < max_threads; t *= 2) config.threads.push_back(t);
+        config.threads.push_back(max_threads);
+    }
+    return config.runs > 0 && config.size_mb > 0 && !config.corpora.empty() && !config.threads.empty() &&
+           !config.chunk_sizes.empty() && !config.levels.empty() && !config.pages.empty();
+}
+
+void writeJson(const std::string& path, const BenchConfig& config, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    out << "{\n  \"corpus_mb\": " << config.size_mb << ",\n  \"runs\": " << config.runs << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "    {\"corpus\": \"" << r.corpus << "\", \"chunk_size\": " << r.chunk_size
+            << ", \"level\": " << r.level << ", \"pages\": \"" << r.pages << "\", \"threads\": " << r.threads
+            << ", \"compress_mbps\": " << r.compress_mbps << ", \"decompress_mbps\": " << r.decompress_mbps
+            << ", \"ratio\": " << r.ratio << ", \"scaling_efficiency\": " << r.efficiency;
+        if (config.perf_counters) {
+            out << ", \"compress_ipc\": " << r.compress_ipc
+                << ", \"compress_cycles_per_byte\": " << r.compress_cycles_per_byte
+                << ", \"decompress_ipc\": " << r.decompress_ipc
+                << ", \"decompress_cycles_per_byte\": " << r.decompress_cycles_per_byte;
+        }
+        if (config.alloc_tracking) {
+            out << ", \"compress_allocs_per_chunk\": " << r.compress_allocs_per_chunk
+                << ", \"compress_peak_heap_bytes\": " << r.compress_peak_heap
+                << ", \"decompress_allocs_per_chunk\": " << r.decompress_allocs_per_chunk;
+        }
+        out << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    ScratchDir dir;
+    if (dir.path.empty()) {
+        std::cerr << "Error: cannot create a directory under " << fs::temp_directory_path() << "\n";
+        return 1;
+    }
+    fs::path input = dir.path / "input.bin";
+    fs::path compressed = dir.path / "compressed.bin";
+    fs::path restored = dir.path / "restored.bin";
+    double size_mb = static_cast<double>(config.size_mb);
+
+    std::cout << std::left << std::setw(8) << "corpus" << std::right << std::setw(10) << "chunk"
+              << std::setw(7) << "level" << std::setw(8) << "pages" << std::setw(9) << "threads"
+              << std::setw(12) << "comp MB/s" << std::setw(12) << "decomp MB/s" << std::setw(9) << "ratio"
+              << std::setw(12) << "efficiency";
+    if (config.perf_counters) {
+        std::cout << std::setw(10) << "comp IPC" << std::setw(12) << "comp cyc/B" << std::setw(12) << "decomp IPC"
+                  << std::setw(13) << "decomp cyc/B";
+    }
+    if (config.alloc_tracking) {
+        std::cout << std::setw(15) << "comp alloc/ch" << std::setw(14) << "comp heap KB" << std::setw(17)
+                  << "decomp alloc/ch";
+    }
+    std::cout << "\n";
+    // The tools print counter and heap totals in their JSON stats when asked.
+    bool capture_stats = config.perf_counters || config.alloc_tracking;
+    std::string perf_flags = std::string(capture_stats ? " --stats=json" : "") +
+                             (config.perf_counters ? " --perf-counters" : "");
+    std::string compressor = config.alloc_tracking ? "./compressor-alloc" : "./compressor";
+    std::string decompressor = config.alloc_tracking ? "./decompressor-alloc" : "./decompressor";
+    bool over_budget = false;
+    bool warned_unavailable = false;
+
+    std::vector<BenchResult> results;
+    for (const std::string& corpus : config.corpora) {
+        generateCorpus(corpus, input, config.size_mb * 1024 * 1024);
+        for (size_t chunk_size : config.chunk_sizes) {
+            for (int level : config.levels) {
+                for (const std::string& pages : config.pages) {
+                    double baseline_mbps = 0;
+                    for (size_t threads : config.threads) {
+                        std::string flags = "--threads " + std::to_string(threads) + " --chunk-size " +
+                                            std::to_string(chunk_size) + " --level " + std::to_string(level) +
+                                            (pages == "huge" ? " --huge-pages" : "");
+                        std::string compress_json, decompress_json;
+                        std::string* compress_out = capture_stats ? &compress_json : nullptr;
+                        std::string* decompress_out = capture_stats ? &decompress_json : nullptr;
+                        double compress_s = bestTime(compressor + " --no-progress" + perf_flags + " " + flags + " " +
+                                                     input.string() + " " + compressed.string(), config.runs,
+                                                     compress_out);
+                        double decompress_s = bestTime(decompressor + " --no-progress" + perf_flags + " " +
+                                                       compressed.string() + " " + restored.string(), config.runs,
+                                                       decompress_out);
+                        if (compress_s < 0 || decompress_s < 0) {
+                            return 1;
+                        }
+                        // A fast decompressor is only worth reporting if it restores the input.
+                        if (std::system(("cmp -s " + input.string() + " " + restored.string()).c_str()) != 0) {
+                            std::cerr << "Error: decompressed output differs from the " << corpus << " corpus with "
+                                      << flags << "\n";
+                            return 1;
+                        }
+
+                        BenchResult r{corpus, chunk_size, level, pages, threads, size_mb / compress_s,
+                                      size_mb / decompress_s,
+                                      static_cast<double>(fs::file_size(input)) / fs::file_size(compressed), 1.0};
+                        if (baseline_mbps == 0) {
+                            baseline_mbps = r.compress_mbps;
+                        }
+                        r.efficiency = r.compress_mbps * config.threads.front() / (baseline_mbps * threads);
+                        if (config.perf_counters) {
+                            if (!warned_unavailable && compress_json.find("\"available\": false") != std::string::npos) {
+                                std::cerr << "Warning: hardware counters unavailable; perf columns will be zero\n";
+                                warned_unavailable = true;
+                            }
+                            r.compress_ipc = jsonNumber(compress_json, "ipc");
+                            r.compress_cycles_per_byte = jsonNumber(compress_json, "cycles_per_byte");
+                            r.decompress_ipc = jsonNumber(decompress_json, "ipc");
+                            r.decompress_cycles_per_byte = jsonNumber(decompress_json, "cycles_per_byte");
+                        }
+                        if (config.alloc_tracking) {
+                            r.compress_allocs_per_chunk = jsonNumber(compress_json, "allocations_per_chunk");
+                            r.compress_peak_heap = jsonNumber(compress_json, "peak_heap_bytes");
+                            r.decompress_allocs_per_chunk = jsonNumber(decompress_json, "allocations_per_chunk");
+                            if (config.max_allocs_per_chunk >= 0 &&
+                                r.compress_allocs_per_chunk > config.max_allocs_per_chunk) {
+                                over_budget = true;
+                            }
+                        }
+                        results.push_back(r);
+
+                        std::cout << std::left << std::setw(8) << corpus << std::right << std::setw(10)
+                                  << chunk_size << std::setw(7) << level << std::setw(8) << pages << std::setw(9)
+                                  << threads << std::fixed << std::setprecision(1) << std::setw(12)
+                                  << r.compress_mbps << std::setw(12) << r.decompress_mbps << std::setprecision(2)
+                                  << std::setw(9) << r.ratio << std::setw(12) << r.efficiency;
+                        if (config.perf_counters) {
+                            std::cout << std::setw(10) << r.compress_ipc << std::setw(12)
+                                      << r.compress_cycles_per_byte << std::setw(12) << r.decompress_ipc
+                                      << std::setw(13) << r.decompress_cycles_per_byte;
+                        }
+                        if (config.alloc_tracking) {
+                            std::cout << std::setw(15) << r.compress_allocs_per_chunk << std::setw(14)
+                                      << r.compress_peak_heap / 1024 << std::setw(17)
+                                      << r.decompress_allocs_per_chunk;
+                        }
+                        std::cout << "\n";
+                    }
+                }
+            }
+        }
+    }
+
+    if (!config.json_path.empty()) {
+        writeJson(config.json_path, config, results);
+        std::cout << "Results written to " << config.json_path << "\n";
+    }
+
+    if (over_budget) {
+        std::cerr << "Error: compression exceeded " << config.max_allocs_per_chunk << " allocations per chunk\n";
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cstddef>
+#include <new>       // For std::bad_alloc
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept> // For std::length_error
+#include <sys/mman.h> // For mmap, madvise
+
+class BufferPool;
+
+// A fixed-capacity buffer checked out of a BufferPool.
+// It is move-only and hands its memory back to the pool when destroyed or reset.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    PooledBuffer(PooledBuffer&& other) noexcept { *this = std::move(other); }
+
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+        if (this != &other) {
+            reset();
+            pool = other.pool;
+            ptr = other.ptr;
+            len = other.len;
+            cap = other.cap;
+            other.pool = nullptr;
+            other.ptr = nullptr;
+            other.len = 0;
+            other.cap = 0;
+        }
+        return *this;
+    }
+
+    ~PooledBuffer() { reset(); }
+
+    unsigned char* data() { return ptr; }
+    const unsigned char* data() const { return ptr; }
+    size_t size() const { return len; }
+    size_t capacity() const { return cap; }
+    bool empty() const { return len == 0; }
+
+    // Sets the number of valid bytes. The capacity never changes.
+    void resize(size_t n) {
+        if (n > cap) {
+            throw std::length_error("PooledBuffer cannot grow beyond its capacity");
+        }
+        len = n;
+    }
+
+    // Returns the memory to the owning pool early.
+    inline void reset();
+
+private:
+    friend class BufferPool;
+    PooledBuffer(BufferPool* owner, unsigned char* memory, size_t capacity)
+        : pool(owner), ptr(memory), len(0), cap(capacity) {}
+
+    BufferPool* pool = nullptr;
+    unsigned char* ptr = nullptr;
+    size_t len = 0;
+    size_t cap = 0;
+};
+
+// How the memory behind a BufferPool slab is obtained.
+enum class PageBacking {
+    Normal,      // Regular 4 KB pages.
+    Transparent, // Regular mapping advised with MADV_HUGEPAGE so the kernel can use THP.
+    Explicit,    // MAP_HUGETLB pages from the reserved hugetlbfs pool.
+};
+
+inline const char* pageBackingName(PageBacking backing) {
+    switch (backing) {
+        case PageBacking::Transparent: return "transparent-huge-pages";
+        case PageBacking::Explicit: return "hugetlb";
+        default: return "normal";
+    }
+}
+
+// A recycling pool of equally sized buffers carved out of one slab.
+// The slab is allocated once up front, so acquiring and releasing buffers
+// never touches the heap. acquire() blocks while every buffer is checked out,
+// which gives the reader natural backpressure against slow workers or writers.
+class BufferPool {
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+    static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    // With huge_pages set the slab is first requested from the hugetlbfs pool and,
+    // if none are reserved, falls back to a THP-advised mapping. backing() reports
+    // what was actually obtained.
+    BufferPool(size_t buffer_size, size_t count, bool huge_pages = false)
+        : buffer_size(buffer_size),
+          stride((buffer_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT),
+          count(count) {
+        if (buffer_size == 0 || count == 0) {
+            throw std::invalid_argument("BufferPool needs a non-zero buffer size and count");
+        }
+        allocateSlab(huge_pages);
+        free_list.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+            free_list.push_back(slab + i * stride);
+    }
+
+    ~BufferPool() {
+        munmap(slab, slab_size);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Checks out a buffer, waiting until one is available.
+    PooledBuffer acquire() {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        available.wait(lock, [this] { return !free_list.empty(); });
+        unsigned char* memory = free_list.back();
+        free_list.pop_back();
+        return PooledBuffer(this, memory, buffer_size);
+    }
+
+    // Writes to every page of the slab so it is faulted in by the calling thread.
+    // Under the kernel's first-touch policy this places the pages on the caller's
+    // NUMA node. Call it before any buffer is checked out.
+    void prefault() {
+        for (size_t offset = 0; offset < slab_size; offset += ALIGNMENT)
+            slab[offset] = 0;
+    }
+
+    size_t bufferSize() const { return buffer_size; }
+    size_t bufferCount() const { return count; }
+    PageBacking backing() const { return page_backing; }
+
+private:
+    friend class PooledBuffer;
+
+    void allocateSlab(bool huge_pages) {
+        slab_size = stride * count;
+        void* memory = MAP_FAILED;
+        if (huge_pages) {
+            // Huge page mappings must be a whole number of huge pages.
+            slab_size = (slab_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+            memory = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED) {
+                page_backing = PageBacking::Explicit;
+            }
+#endif
+        }
+        if (memory == MAP_FAILED) {
+            memory = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            if (huge_pages && madvise(memory, slab_size, MADV_HUGEPAGE) == 0) {
+                page_backing = PageBacking::Transparent;
+            }
+#endif
+        }
+        slab = static_cast<unsigned char*>(memory);
+    }
+
+    void release(unsigned char* memory) {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            free_list.push_back(memory);
+        }
+        available.notify_one();
+    }
+
+    const size_t buffer_size;
+    const size_t stride;
+    const size_t count;
+    unsigned char* slab = nullptr;
+    size_t slab_size = 0;
+    PageBacking page_backing = PageBacking::Normal;
+    std::vector<unsigned char*> free_list;
+    std::mutex pool_mutex;
+    std::condition_variable available;
+};
+
+inline void PooledBuffer::reset() {
+    if (pool) {
+        pool->release(ptr);
+    }
+    pool = nullptr;
+    ptr = nullptr;
+    len = 0;
+    cap = 0;
+}
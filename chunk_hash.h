@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>   // For std::memcpy
+
+// Content digests for chunk deduplication.
+//
+// XXH64 runs at several GB/s per core, far ahead of deflate, so hashing every
+// chunk on the worker costs little next to the compression it can save. A
+// duplicate is trusted on its digest alone without comparing bytes, so the
+// digest is two XXH64 passes with independent seeds: 128 bits, which makes an
+// accidental collision between chunks of the same input vanishingly unlikely.
+// It is not cryptographic; inputs crafted to collide are not defended against.
+
+namespace xxh64 {
+
+const uint64_t PRIME1 = 0x9E3779B185EBCA87;
+const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4F;
+const uint64_t PRIME3 = 0x165667B19E3779F9;
+const uint64_t PRIME4 = 0x85EBCA77C2B2AE63;
+const uint64_t PRIME5 = 0x27D4EB2F165667C5;
+
+inline uint64_t rotl(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+inline uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * PRIME2, 31) * PRIME1; }
+
+inline uint64_t mergeRound(uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * PRIME1 + PRIME4; }
+
+// XXH64 of `size` bytes at `data`, matching the reference implementation.
+inline uint64_t hash(const unsigned char* data, size_t size, uint64_t seed) {
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        for (; end - p >= 32; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+    h += size;
+    for (; end - p >= 8; p += 8)
+        h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (end - p >= 4) {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+} // namespace xxh64
+
+struct ChunkDigest {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const ChunkDigest& other) const { return low == other.low && high == other.high; }
+};
+
+// For unordered containers keyed by digest; the bits are already well mixed.
+struct ChunkDigestHash {
+    size_t operator()(const ChunkDigest& digest) const { return digest.low; }
+};
+
+inline ChunkDigest digestChunk(const unsigned char* data, size_t size) {
+    return {xxh64::hash(data, size, 0), xxh64::hash(data, size, 0x6d74637a64656475)}; // "mtczdedu"
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Content-defined chunk boundaries with the Gear rolling hash, as in FastCDC.
+//
+// Each byte shifts the hash left and adds a random value for that byte, so the
+// top bits of the hash depend only on the last few dozen bytes and a boundary
+// is found wherever those bytes happen to make the masked bits zero. An insert
+// or delete therefore only moves the boundaries next to it; later chunks come
+// out identical. Cut points are normalized toward the average: before it a
+// mask with two more bits makes a cut four times less likely, after it a mask
+// with two fewer bits makes one four times more likely. Sizes stay within
+// [average / 4, average * 4], the first minimum bytes of a chunk are not
+// hashed at all, and nothing here depends on the data that came before the
+// chunk, so the same content always cuts the same way.
+
+// The Gear table: fixed pseudo-random values (splitmix64), so boundaries are
+// stable across builds and machines.
+constexpr std::array<uint64_t, 256> makeGearTable() {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x6d74637a63646331; // "mtczcdc1"
+    for (auto& value : table) {
+        state += 0x9e3779b97f4a7c15;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        value = z ^ (z >> 31);
+    }
+    return table;
+}
+
+inline constexpr std::array<uint64_t, 256> GEAR_TABLE = makeGearTable();
+
+// GEAR_TABLE shifted left once, for hashing two bytes per step.
+constexpr std::array<uint64_t, 256> makeShiftedGearTable() {
+    std::array<uint64_t, 256> table = makeGearTable();
+    for (auto& value : table)
+        value <<= 1;
+    return table;
+}
+
+inline constexpr std::array<uint64_t, 256> GEAR_TABLE_SHIFTED = makeShiftedGearTable();
+
+class ContentDefinedChunker {
+public:
+    // `average` is rounded down to a power of two (at least 256).
+    explicit ContentDefinedChunker(size_t average) {
+        int bits = 8;
+        while ((size_t(1) << (bits + 1)) <= average && bits < 40)
+            ++bits;
+        avg_size = size_t(1) << bits;
+        min_size = avg_size / 4;
+        max_size = avg_size * 4;
+        mask_small = topBits(bits + 2);
+        mask_large = topBits(bits - 2);
+    }
+
+    size_t minSize() const { return min_size; }
+    size_t averageSize() const { return avg_size; }
+    size_t maxSize() const { return max_size; }
+
+    // Returns the length of the chunk starting at `data`. `size` is what is
+    // available; if it is less than maxSize() and no boundary is found, the
+    // whole of it is returned (the caller is at end of input).
+    size_t findBoundary(const unsigned char* data, size_t size) const {
+        if (size <= min_size) {
+            return size;
+        }
+        size_t end = size < max_size ? size : max_size;
+        size_t normal = end < avg_size ? end : avg_size;
+        uint64_t hash = 0;
+        size_t i = min_size;
+        size_t cut = scan(data, i, normal, hash, mask_small);
+        if (!cut) {
+            cut = scan(data, i, end, hash, mask_large);
+        }
+        return cut ? cut : end;
+    }
+
+private:
+    size_t min_size;
+    size_t avg_size;
+    size_t max_size;
+    uint64_t mask_small; // Harder to match; used below the average size.
+    uint64_t mask_large; // Easier to match; used from the average size on.
+
+    static constexpr uint64_t topBits(int count) { return count <= 0 ? 0 : ~uint64_t(0) << (64 - count); }
+
+    // Hashes data[i, end) on from `hash` and returns the length up to the first
+    // cut under `mask`, or 0 with `i` and `hash` advanced to `end`. One byte at
+    // a time the shift and add form a serial chain of two cycles per byte, so
+    // the loop takes two per step: the pair's contribution is summed off the
+    // chain, and the hash after the first byte of the pair is derived from the
+    // old one just for its test. The cuts are exactly those of a bytewise loop.
+    static size_t scan(const unsigned char* data, size_t& i, size_t end, uint64_t& hash, uint64_t mask) {
+        for (; i + 2 <= end; i += 2) {
+            uint64_t first = (hash << 1) + GEAR_TABLE[data[i]];
+            hash = (hash << 2) + (GEAR_TABLE_SHIFTED[data[i]] + GEAR_TABLE[data[i + 1]]);
+            if (!(first & mask)) {
+                return i + 1;
+            }
+            if (!(hash & mask)) {
+                return i + 2;
+            }
+        }
+        for (; i < end; ++i) {
+            hash = (hash << 1) + GEAR_TABLE[data[i]];
+            if (!(hash & mask)) {
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+};
@@ -0,0 +1,164 @@
+#include "codec.h"
+#include <string>
+#include <stdexcept> // For std::runtime_error
+#include "alloc_tracker.h"
+#include "chunker.h"
+
+namespace {
+
+// Owns one zlib deflate stream per worker thread so its internal state is
+// allocated once and reset between chunks instead of rebuilt by compress().
+struct Deflater {
+    z_stream stream{};
+    int level = Z_DEFAULT_COMPRESSION;
+
+    Deflater() {
+        stream.zalloc = alloc_tracking::zlibAlloc;
+        stream.zfree = alloc_tracking::zlibFree;
+        if (deflateInit(&stream, level) != Z_OK) {
+            throw std::runtime_error("deflateInit failed");
+        }
+    }
+
+    ~Deflater() {
+        deflateEnd(&stream);
+    }
+};
+
+// Owns one zlib inflate stream per thread so its window is allocated once and
+// reset between chunks instead of rebuilt by uncompress().
+struct Inflater {
+    z_stream stream{};
+
+    Inflater() {
+        stream.zalloc = alloc_tracking::zlibAlloc;
+        stream.zfree = alloc_tracking::zlibFree;
+        if (inflateInit(&stream) != Z_OK) {
+            throw std::runtime_error("inflateInit failed");
+        }
+    }
+
+    ~Inflater() {
+        inflateEnd(&stream);
+    }
+};
+
+// Where rsyncable output flushes deflate.
+const ContentDefinedChunker RSYNCABLE_SEGMENTS(RSYNCABLE_SEGMENT_SIZE);
+
+// A sync flush ends the current block and adds an empty stored block, each at
+// most 5 bytes; the rest is margin.
+const size_t FLUSH_OVERHEAD = 16;
+
+} // namespace
+
+size_t compressedBound(size_t size, bool rsyncable) {
+    size_t bound = compressBound(size);
+    if (rsyncable) {
+        bound += (size / RSYNCABLE_SEGMENTS.minSize() + 1) * FLUSH_OVERHEAD;
+    }
+    return bound;
+}
+
+size_t compressBytes(const unsigned char* input, size_t size, unsigned char* output, size_t capacity, int level,
+                     bool rsyncable, const unsigned char* dictionary, size_t dictionary_size) {
+    if (size == 0) {
+        return 0;
+    }
+    thread_local Deflater deflater;
+    z_stream& stream = deflater.stream;
+    if (deflateReset(&stream) != Z_OK) {
+        throw std::runtime_error("Compression failed");
+    }
+    if (level != deflater.level) {
+        // Switching level on a freshly reset stream needs no flush.
+        if (deflateParams(&stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Invalid compression level " + std::to_string(level));
+        }
+        deflater.level = level;
+    }
+    if (dictionary_size > 0 && deflateSetDictionary(&stream, dictionary, dictionary_size) != Z_OK) {
+        throw std::runtime_error("Compression failed: could not set dictionary");
+    }
+    stream.next_in = const_cast<Bytef*>(input);
+    stream.next_out = output;
+    stream.avail_out = capacity;
+
+    if (rsyncable) {
+        // One call per segment, each ending in a sync flush and the last in Z_FINISH.
+        size_t offset = 0;
+        while (offset < size) {
+            size_t n = RSYNCABLE_SEGMENTS.findBoundary(input + offset, size - offset);
+            offset += n;
+            bool last = offset == size;
+            stream.avail_in = n;
+            int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+            // Out of room before a flush completes would leave output behind.
+            if (result != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0 || (!last && stream.avail_out == 0)) {
+                throw std::runtime_error("Compression failed");
+            }
+        }
+        return stream.total_out;
+    }
+
+    // Perform compression in a single call; the bound guarantees enough room.
+    stream.avail_in = size;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        throw std::runtime_error("Compression failed");
+    }
+
+    // Report the actual compressed size.
+    return stream.total_out;
+}
+
+void compressData(const PooledBuffer& input, PooledBuffer& output, int level, bool rsyncable,
+                  const unsigned char* dictionary, size_t dictionary_size) {
+    output.resize(0);
+    output.resize(compressBytes(input.data(), input.size(), output.data(), output.capacity(), level, rsyncable,
+                                dictionary, dictionary_size));
+}
+
+size_t decompressBytes(const unsigned char* input, size_t size, unsigned char* output, size_t capacity,
+                       const unsigned char* dictionary, size_t dictionary_size) {
+    thread_local Inflater inflater;
+    z_stream& stream = inflater.stream;
+    if (inflateReset(&stream) != Z_OK) {
+        throw std::runtime_error("Decompression failed: could not reset inflate stream");
+    }
+    stream.next_in = const_cast<Bytef*>(input);
+    stream.avail_in = size;
+    stream.next_out = output;
+    stream.avail_out = capacity;
+
+    // Perform the decompression in a single call, stopping once if the stream
+    // asks for its preset dictionary.
+    int result = inflate(&stream, Z_FINISH);
+    if (result == Z_NEED_DICT) {
+        if (dictionary_size == 0) {
+            throw std::runtime_error("Decompression failed: the data needs a dictionary");
+        }
+        if (inflateSetDictionary(&stream, dictionary, dictionary_size) != Z_OK) {
+            throw std::runtime_error("Decompression failed: wrong dictionary");
+        }
+        result = inflate(&stream, Z_FINISH);
+    }
+
+    if (result != Z_STREAM_END) {
+        // Z_BUF_ERROR means the destination buffer was too small, which shouldn't
+        // happen if the header's chunk size is honest. Other errors indicate corrupt data.
+        throw std::runtime_error("Decompression failed with zlib error: " + std::to_string(result));
+    }
+
+    // Report the actual size of the decompressed data.
+    return stream.total_out;
+}
+
+void decompressData(const PooledBuffer& input, PooledBuffer& output, const unsigned char* dictionary,
+                    size_t dictionary_size) {
+    output.resize(0);
+    if (input.empty()) {
+        return;
+    }
+    output.resize(decompressBytes(input.data(), input.size(), output.data(), output.capacity(), dictionary,
+                                  dictionary_size));
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <zlib.h> // Requires linking with -lz
+#include "buffer_pool.h"
+
+// Single-chunk zlib codecs shared by the compressor and decompressor. Each thread
+// keeps its own deflate/inflate stream and resets it between chunks, so steady-state
+// use does no allocation.
+
+// With `rsyncable`, deflate ends its block and byte-aligns the output
+// (Z_SYNC_FLUSH) at content-defined points averaging RSYNCABLE_SEGMENT_SIZE
+// apart, as gzip --rsyncable does. Block boundaries then follow the content,
+// and matches only reach back 32 KB, so once past an edit the compressed bytes
+// come out as before even if the edit shifted everything after it. Each flush
+// costs a few bytes; on text the output grows by under 1%.
+const size_t RSYNCABLE_SEGMENT_SIZE = 8192;
+
+// Upper bound on the compressed size of `size` bytes: compressBound() plus room
+// for the flushes of rsyncable output.
+size_t compressedBound(size_t size, bool rsyncable);
+
+// Compresses `size` bytes into `output` and returns the compressed size. `capacity`
+// must be at least compressedBound(size, rsyncable). If given, `dictionary` is
+// preset as history the data can refer back to (deflate uses its last 32 KB),
+// and the same bytes must be passed to decompressBytes().
+size_t compressBytes(const unsigned char* input, size_t size, unsigned char* output, size_t capacity,
+                     int level = Z_DEFAULT_COMPRESSION, bool rsyncable = false,
+                     const unsigned char* dictionary = nullptr, size_t dictionary_size = 0);
+
+// Inflates one zlib stream of `size` bytes into `output` and returns the
+// uncompressed size. Throws if the data is corrupt, does not fit in `capacity`,
+// or needs a dictionary that was not given.
+size_t decompressBytes(const unsigned char* input, size_t size, unsigned char* output, size_t capacity,
+                       const unsigned char* dictionary = nullptr, size_t dictionary_size = 0);
+
+// Compresses a chunk into a pooled output buffer using zlib at the given level.
+// The output buffer must have at least compressedBound(input.size(), rsyncable) bytes of capacity.
+// A trained dictionary (see dictionary.h), if given, is preloaded.
+void compressData(const PooledBuffer& input, PooledBuffer& output, int level = Z_DEFAULT_COMPRESSION,
+                  bool rsyncable = false, const unsigned char* dictionary = nullptr, size_t dictionary_size = 0);
+
+// Decompresses a chunk into a pooled output buffer using zlib, with the
+// dictionary it was compressed with, if any.
+// It assumes the uncompressed data for a single chunk will not exceed the output capacity.
+void decompressData(const PooledBuffer& input, PooledBuffer& output, const unsigned char* dictionary = nullptr,
+                    size_t dictionary_size = 0);
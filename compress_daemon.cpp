@@ -0,0 +1,422 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm> // For std::min
+#include <cstring>   // For std::memcmp
+#include <iterator>  // For std::make_move_iterator
+#include <csignal>   // For std::signal
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h> // For umask
+#include <sys/time.h> // For timeval
+#include <sys/un.h>
+#include <unistd.h>
+#include "mtcompress.h"
+#include "thread_pool.h"
+#include "daemon_protocol.h"
+
+// mtcompressd: a long-running compression service on a Unix socket. Every
+// connection shares one Compressor, and decompression borrows its workers, so
+// --threads caps the CPU used by all clients together. Connection threads only
+// move bytes; small compression requests are gathered into batches so a burst
+// of them costs one queueing round instead of one pipeline run each.
+
+using namespace daemon_protocol;
+
+// Command-line options for the daemon.
+struct Options {
+    std::string socket_path = defaultSocketPath();
+    mtc::Options engine;      // Threads, chunk size and level shared by every request.
+    size_t connections = 16;  // Connections served at once; later ones wait for a free handler.
+    std::chrono::microseconds batch_window{500}; // How long a batch stays open for more requests.
+    size_t batch_limit = 64;  // Requests that close a batch early.
+};
+
+// Collects small compression requests from the connection threads and hands
+// them to the workers through Compressor::compressBatch(). A batch closes when
+// `limit` requests are waiting or `window` has passed since its first arrived;
+// requests that come in while a batch runs form the next one.
+class SmallRequestBatcher {
+public:
+    SmallRequestBatcher(mtc::Compressor& compressor, std::chrono::microseconds window, size_t limit)
+        : compressor(compressor), window(window), limit(limit), thread([this] { run(); }) {}
+
+    // Compresses what is already queued, then stops.
+    ~SmallRequestBatcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    std::future<mtc::Buffer> submit(mtc::Buffer input) {
+        std::promise<mtc::Buffer> promise;
+        std::future<mtc::Buffer> result = promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back({std::move(input), std::move(promise)});
+        }
+        wake.notify_all();
+        return result;
+    }
+
+private:
+    struct Request {
+        mtc::Buffer input;
+        std::promise<mtc::Buffer> result;
+    };
+
+    mtc::Compressor& compressor;
+    const std::chrono::microseconds window;
+    const size_t limit;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Request> pending;
+    bool stopping = false;
+    std::thread thread; // Last, so it starts after the rest is initialized.
+
+    void run() {
+        while (true) {
+            std::vector<Request> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                wake.wait_for(lock, window, [this] { return stopping || pending.size() >= limit; });
+                size_t count = std::min(pending.size(), limit);
+                batch.assign(std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.begin() + count));
+                pending.erase(pending.begin(), pending.begin() + count);
+            }
+
+            std::vector<mtc::Buffer> inputs;
+            inputs.reserve(batch.size());
+            for (auto& request : batch)
+                inputs.push_back(std::move(request.input));
+            try {
+                std::vector<mtc::Buffer> outputs = compressor.compressBatch(inputs);
+                for (size_t i = 0; i < batch.size(); ++i)
+                    batch[i].result.set_value(std::move(outputs[i]));
+            } catch (...) {
+                for (auto& request : batch)
+                    request.result.set_exception(std::current_exception());
+            }
+        }
+    }
+};
+
+std::atomic<bool> stop_requested(false);
+
+// Once a request has started, each read or write on its connection may wait
+// this long. A client that stalls mid-request is dropped rather than holding
+// one of the few handlers, and shutdown never waits on it for longer.
+const int IO_TIMEOUT_SECONDS = 10;
+
+void requestStop(int) {
+    stop_requested = true;
+}
+
+// The engines every connection shares.
+struct Service {
+    mtc::Compressor compressor;
+    mtc::Decompressor decompressor;
+    SmallRequestBatcher batcher;
+
+    explicit Service(const Options& options)
+        : compressor(options.engine), decompressor(compressor),
+          batcher(compressor, options.batch_window, options.batch_limit) {}
+};
+
+// Reads a uint32_t length and that many bytes of path.
+bool readPath(int fd, std::string& path) {
+    uint32_t length;
+    if (!readAll(fd, &length, sizeof(length)) || length == 0 || length > MAX_PATH_LENGTH) {
+        return false;
+    }
+    path.resize(length);
+    return readAll(fd, &path[0], length);
+}
+
+// Runs one file-to-file request. Throws std::runtime_error on failure.
+void runFiles(Service& service, Op op, const std::string& input_path, const std::string& output_path) {
+    if (input_path[0] != '/' || output_path[0] != '/') {
+        throw std::runtime_error("Paths must be absolute");
+    }
+    std::ifstream in(input_path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Could not open input file " + input_path);
+    }
+    std::ofstream out(output_path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Could not open output file " + output_path);
+    }
+    if (op == OP_COMPRESS) {
+        service.compressor.compress(in, out);
+    } else {
+        service.decompressor.decompress(in, out);
+    }
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Could not write output file " + output_path);
+    }
+}
+
+// Runs one in-memory request. Inputs that fit in a chunk join a batch.
+mtc::Buffer runBytes(Service& service, Op op, mtc::Buffer input) {
+    if (op == OP_DECOMPRESS) {
+        return service.decompressor.decompress(input);
+    }
+    if (input.size() <= service.compressor.options().chunk_size) {
+        return service.batcher.submit(std::move(input)).get();
+    }
+    return service.compressor.compress(input);
+}
+
+bool respond(int fd, Status status, const unsigned char* data, uint64_t size) {
+    uint8_t code = status;
+    return writeAll(fd, &code, sizeof(code)) && writeAll(fd, &size, sizeof(size)) && writeAll(fd, data, size);
+}
+
+bool respondError(int fd, const std::string& message) {
+    return respond(fd, STATUS_ERROR, reinterpret_cast<const unsigned char*>(message.data()), message.size());
+}
+
+// Waits for the next request on an idle connection. Returns false if the
+// daemon is stopping first. Idle connections may wait indefinitely; only the
+// reads after this are bounded by IO_TIMEOUT_SECONDS.
+bool awaitRequest(int fd) {
+    while (!stop_requested) {
+        pollfd ready = {fd, POLLIN, 0};
+        if (::poll(&ready, 1, 200) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Answers requests on `fd` until the client hangs up, breaks the protocol or
+// the daemon stops. The whole input is read before any output is written, so
+// a client that sends everything before reading cannot deadlock against the
+// daemon.
+void serveConnection(int fd, Service& service) {
+    while (true) {
+        unsigned char header[REQUEST_HEADER_SIZE];
+        if (!awaitRequest(fd) || !readAll(fd, header, sizeof(header))) {
+            return;
+        }
+        Op op = static_cast<Op>(header[4]);
+        Source source = static_cast<Source>(header[5]);
+        if (std::memcmp(header, MAGIC, sizeof(MAGIC)) != 0 || (op != OP_COMPRESS && op != OP_DECOMPRESS) ||
+            (source != SOURCE_PATHS && source != SOURCE_BYTES)) {
+            respondError(fd, "Malformed request");
+            return;
+        }
+
+        if (source == SOURCE_PATHS) {
+            std::string input_path, output_path;
+            if (!readPath(fd, input_path) || !readPath(fd, output_path)) {
+                respondError(fd, "Malformed request");
+                return;
+            }
+            bool sent;
+            try {
+                runFiles(service, op, input_path, output_path);
+                sent = respond(fd, STATUS_OK, nullptr, 0);
+            } catch (const std::exception& e) {
+                sent = respondError(fd, e.what());
+            }
+            if (!sent) {
+                return;
+            }
+            continue;
+        }
+
+        uint64_t size;
+        if (!readAll(fd, &size, sizeof(size))) {
+            return;
+        }
+        if (size > MAX_BYTES_REQUEST) {
+            respondError(fd, "Request too large; pass file paths instead");
+            return;
+        }
+        mtc::Buffer input(size);
+        if (!readAll(fd, input.data(), size)) {
+            return;
+        }
+        bool sent;
+        try {
+            mtc::Buffer output = runBytes(service, op, std::move(input));
+            sent = respond(fd, STATUS_OK, output.data(), output.size());
+        } catch (const std::exception& e) {
+            sent = respondError(fd, e.what());
+        }
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "Options:\n"
+              << "  --socket PATH         Unix socket to listen on (default " << defaultSocketPath() << ")\n"
+              << "  --threads N           Worker threads shared by all requests (default: allowed CPUs, capped by cgroup quota)\n"
+              << "  --chunk-size N        Uncompressed bytes per chunk (default 1048576)\n"
+              << "  --level N             zlib compression level 0-9 (default 6)\n"
+              << "  --max-jobs N          Large compression jobs that may run at once (default 4)\n"
+              << "  --connections N       Connections served at once (default 16)\n"
+              << "  --batch-window-us N   How long small requests wait for company (default 500)\n"
+              << "  --batch-limit N       Small requests per batch (default 64)\n";
+}
+
+// Parses flags. Returns false on bad usage.
+bool parseArgs(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            options.socket_path = argv[++i];
+        } else if ((arg == "--threads" || arg == "--chunk-size" || arg == "--level" || arg == "--max-jobs" ||
+                    arg == "--connections" || arg == "--batch-window-us" || arg == "--batch-limit") && i + 1 < argc) {
+            std::string value = argv[++i];
+            bool valid = true;
+            try {
+                if (arg == "--threads") {
+                    options.engine.threads = std::stoul(value);
+                    valid = options.engine.threads > 0;
+                } else if (arg == "--chunk-size") {
+                    options.engine.chunk_size = std::stoul(value);
+                    valid = options.engine.chunk_size > 0 && options.engine.chunk_size <= MAX_CHUNK_SIZE;
+                } else if (arg == "--level") {
+                    options.engine.level = std::stoi(value);
+                    valid = options.engine.level >= 0 && options.engine.level <= 9;
+                } else if (arg == "--max-jobs") {
+                    options.engine.max_jobs = std::stoul(value);
+                    valid = options.engine.max_jobs > 0;
+                } else if (arg == "--connections") {
+                    options.connections = std::stoul(value);
+                    valid = options.connections > 0;
+                } else if (arg == "--batch-window-us") {
+                    options.batch_window = std::chrono::microseconds(std::stoul(value));
+                } else {
+                    options.batch_limit = std::stoul(value);
+                    valid = options.batch_limit > 0;
+                }
+            } catch (const std::exception&) {
+                valid = false;
+            }
+            if (!valid) {
+                std::cerr << "Error: Invalid value for " << arg << ": " << value << "\n";
+                return false;
+            }
+        } else {
+            std::cerr << "Error: Unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Binds and listens on `path`, replacing a stale socket left by a daemon that
+// did not exit cleanly. Returns -1 if another daemon is answering there.
+int listenOn(const std::string& path) {
+    sockaddr_un address;
+    if (!socketAddress(path, address)) {
+        std::cerr << "Error: Socket path too long: " << path << "\n";
+        return -1;
+    }
+    std::string ignored;
+    int probe = connectTo(path, ignored);
+    if (probe >= 0) {
+        ::close(probe);
+        std::cerr << "Error: A daemon is already listening on " << path << "\n";
+        return -1;
+    }
+    ::unlink(path.c_str());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // Only the owner may connect: requests read and write files as the daemon's user.
+    mode_t previous_mask = ::umask(0077);
+    bool bound = fd >= 0 && ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    ::umask(previous_mask);
+    if (!bound || ::listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "Error: Could not listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+
+    int listener = listenOn(options.socket_path);
+    if (listener < 0) {
+        return 1;
+    }
+
+    try {
+        Service service(options);
+        std::cout << "Listening on " << options.socket_path << " with " << service.compressor.threads()
+                  << " worker threads.\n" << std::flush;
+
+        // Connection threads wait on sockets and on results; the CPU work runs
+        // on the service's workers. Declared after `service` so every handler
+        // has returned before the engines go away.
+        ThreadPool handlers(options.connections);
+        while (!stop_requested) {
+            // Poll with a timeout so a signal is noticed promptly.
+            pollfd ready = {listener, POLLIN, 0};
+            if (::poll(&ready, 1, 200) <= 0) {
+                continue;
+            }
+            int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            timeval timeout = {IO_TIMEOUT_SECONDS, 0};
+            ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            // With every handler busy the connection waits in the pool's queue.
+            handlers.enqueue([&, client] {
+                try {
+                    serveConnection(client, service);
+                } catch (const std::exception& e) {
+                    std::cerr << "Error: " << e.what() << '\n';
+                }
+                ::close(client);
+            });
+        }
+
+        // Requests in progress finish; idle connections are closed.
+        std::cout << "Shutting down.\n";
+        handlers.shutdown();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        ::close(listener);
+        ::unlink(options.socket_path.c_str());
+        return 1;
+    }
+
+    ::close(listener);
+    ::unlink(options.socket_path.c_str());
+    return 0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>   // For uint32_t
+#include <cstring>   // For std::memcpy, std::memcmp, std::memset
+#include <ostream>
+
+// Layout of a compressed file:
+//
+//   FileHeader                       (16 bytes, optional for legacy files)
+//   repeated per chunk, in order:
+//     uint32_t compressed_size
+//     uint32_t uncompressed_size     (only with FLAG_CONTENT_DEFINED)
+//     compressed_size bytes of zlib data, or with FLAG_DELTA a delta chunk
+//       (see delta.h)
+//   or, with FLAG_DEDUP, for a chunk identical to an earlier one:
+//     uint32_t DUPLICATE_CHUNK
+//     uint64_t record_offset         (file offset of the record holding the data)
+//
+// With FLAG_CHUNK_INDEX the chunks are followed by an index of their contents,
+// so a later run can copy unchanged ones instead of compressing them again:
+//
+//   uint32_t 0                       (ends the chunks)
+//   repeated per chunk, in order:
+//     uint64_t data_offset           (file offset of the chunk's zlib data; for
+//                                     a duplicate, the original's)
+//     uint32_t compressed_size
+//     uint32_t uncompressed_size
+//     uint64_t digest[2]             (of the uncompressed bytes; see chunk_hash.h)
+//   uint64_t index_offset            (file offset of the first entry)
+//   uint32_t chunk_count
+//   char magic[4] = "MTCI"
+//
+// Files written before the header existed start directly with the first chunk and
+// always used 1 MB chunks. The magic cannot collide with them because a chunk size
+// prefix is never anywhere near 0x5A43544D bytes.
+//
+// An archive (FLAG_ARCHIVE) holds many files. Their contents are concatenated in
+// table order and chunked as a single stream, so small files share chunks. A
+// file no larger than a chunk never straddles two: the chunk before it is
+// closed early instead, so chunks may hold less than chunk_size. The chunks are
+// followed by:
+//
+//   uint32_t 0                       (ends the chunks; zlib never emits 0 bytes)
+//   uint32_t entry_count
+//   repeated per entry, in order:
+//     uint16_t path_length, path bytes (relative, '/'-separated)
+//     uint8_t type                   (ARCHIVE_FILE or ARCHIVE_DIRECTORY)
+//     uint32_t mode                  (permission bits)
+//     int64_t mtime_ns               (modification time since the epoch)
+//     uint64_t size                  (uncompressed bytes; 0 for directories)
+//     uint32_t chunk, uint32_t offset (where the data starts: chunk index and
+//                                      offset into its uncompressed bytes)
+//   uint32_t chunk_count
+//   repeated per chunk, in order:
+//     uint64_t offset                (file offset of the chunk's size prefix)
+//     uint32_t size                  (uncompressed bytes)
+//   uint64_t table_offset            (file offset of entry_count)
+//   char magic[4] = "MTCA"
+
+// The chunk size used when none is given, and the one implied by headerless files.
+const size_t DEFAULT_CHUNK_SIZE = 1024 * 1024; // 1 MB
+
+// Upper limit on the uncompressed size of one chunk.
+const size_t MAX_CHUNK_SIZE = 256 * 1024 * 1024; // 256 MB
+
+const char FORMAT_MAGIC[4] = {'M', 'T', 'C', 'Z'};
+const uint16_t FORMAT_VERSION = 1;
+
+// FileHeader::flags bits.
+const uint16_t FLAG_ARCHIVE = 1;
+// Chunks were cut at content-defined boundaries, so their sizes vary up to
+// chunk_size and each one records its uncompressed size.
+const uint16_t FLAG_CONTENT_DEFINED = 2;
+// Repeated chunks are stored once; later copies are records that point back
+// at it. The record pointed to always holds data itself, never another pointer.
+const uint16_t FLAG_DEDUP = 4;
+
+// The chunks are followed by a chunk index.
+const uint16_t FLAG_CHUNK_INDEX = 8;
+// Chunks were compressed against a reference file, whose checksum is in
+// FileHeader::dictionary_id; decoding needs the same file.
+const uint16_t FLAG_DELTA = 16;
+// Chunks were compressed with a preset dictionary, identified by
+// FileHeader::dictionary_id; decoding needs the same dictionary.
+const uint16_t FLAG_DICTIONARY = 32;
+// Every flag this reader understands. Any other bit may change how the records
+// are laid out, so a file that sets one is refused rather than misread.
+const uint16_t KNOWN_FLAGS =
+    FLAG_ARCHIVE | FLAG_CONTENT_DEFINED | FLAG_DEDUP | FLAG_CHUNK_INDEX | FLAG_DELTA | FLAG_DICTIONARY;
+
+// Size prefix of a duplicate record. Real compressed sizes stay far below it.
+const uint32_t DUPLICATE_CHUNK = 0xFFFFFFFF;
+
+const char INDEX_MAGIC[4] = {'M', 'T', 'C', 'I'};
+const size_t INDEX_ENTRY_SIZE = 32;
+const size_t INDEX_TRAILER_SIZE = 16; // index_offset, chunk_count and magic.
+
+const char ARCHIVE_MAGIC[4] = {'M', 'T', 'C', 'A'};
+const size_t ARCHIVE_TRAILER_SIZE = 12; // table_offset and magic.
+const uint8_t ARCHIVE_FILE = 0;
+const uint8_t ARCHIVE_DIRECTORY = 1;
+
+struct FileHeader {
+    uint16_t version = FORMAT_VERSION;
+    uint16_t flags = 0;
+    uint32_t chunk_size = DEFAULT_CHUNK_SIZE; // Maximum uncompressed bytes per chunk.
+    uint32_t dictionary_id = 0; // Identifies the data chunks were compressed against; zero if none.
+};
+
+const size_t FILE_HEADER_SIZE = 16;
+
+// Serializes the header into its 16-byte on-disk form.
+inline void encodeFileHeader(const FileHeader& header, unsigned char bytes[FILE_HEADER_SIZE]) {
+    std::memset(bytes, 0, FILE_HEADER_SIZE);
+    std::memcpy(bytes, FORMAT_MAGIC, sizeof(FORMAT_MAGIC));
+    std::memcpy(bytes + 4, &header.version, sizeof(header.version));
+    std::memcpy(bytes + 6, &header.flags, sizeof(header.flags));
+    std::memcpy(bytes + 8, &header.chunk_size, sizeof(header.chunk_size));
+    std::memcpy(bytes + 12, &header.dictionary_id, sizeof(header.dictionary_id));
+}
+
+inline void writeFileHeader(std::ostream& out, const FileHeader& header) {
+    unsigned char bytes[FILE_HEADER_SIZE];
+    encodeFileHeader(header, bytes);
+    out.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+// Returns true if the first four bytes of a file are the header magic. Otherwise the
+// file is a legacy headerless one and those bytes are the first chunk's size prefix.
+inline bool isFileHeaderMagic(const unsigned char bytes[4]) {
+    return std::memcmp(bytes, FORMAT_MAGIC, sizeof(FORMAT_MAGIC)) == 0;
+}
+
+// Decodes a complete 16-byte header. Returns false for unsupported versions or
+// implausible chunk sizes.
+inline bool decodeFileHeader(const unsigned char bytes[FILE_HEADER_SIZE], FileHeader& header) {
+    if (!isFileHeaderMagic(bytes)) {
+        return false;
+    }
+    std::memcpy(&header.version, bytes + 4, sizeof(header.version));
+    std::memcpy(&header.flags, bytes + 6, sizeof(header.flags));
+    std::memcpy(&header.chunk_size, bytes + 8, sizeof(header.chunk_size));
+    std::memcpy(&header.dictionary_id, bytes + 12, sizeof(header.dictionary_id));
+    return header.version == FORMAT_VERSION && header.chunk_size > 0 && header.chunk_size <= MAX_CHUNK_SIZE;
+}
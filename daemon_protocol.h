@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cerrno>
+#include <climits>   // For PATH_MAX
+#include <cstdint>
+#include <cstdlib>   // For std::getenv
+#include <cstring>   // For std::memcpy, std::memset, std::strerror
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>  // For sockaddr_un
+#include <unistd.h>  // For read, close, getcwd
+
+// Wire format between mtcompressd and its clients over a Unix stream socket.
+// A connection carries any number of requests, each answered before the next
+// is read:
+//
+//   Request:  char magic[4] = "MTCD", uint8_t op, uint8_t source, uint16_t reserved
+//             SOURCE_PATHS: uint32_t length + input path, uint32_t length + output path
+//             SOURCE_BYTES: uint64_t length + input bytes
+//   Response: uint8_t status, uint64_t length + payload
+//
+// The payload is the output for SOURCE_BYTES, empty for SOURCE_PATHS, and the
+// error message when the status is STATUS_ERROR. Integers are in host byte
+// order since the socket never leaves the machine. Paths are opened by the
+// daemon, so they must be absolute.
+
+namespace daemon_protocol {
+
+const char MAGIC[4] = {'M', 'T', 'C', 'D'};
+const size_t REQUEST_HEADER_SIZE = 8;
+
+enum Op : uint8_t { OP_COMPRESS = 1, OP_DECOMPRESS = 2 };
+enum Source : uint8_t { SOURCE_PATHS = 1, SOURCE_BYTES = 2 };
+enum Status : uint8_t { STATUS_OK = 0, STATUS_ERROR = 1 };
+
+// Largest SOURCE_BYTES input the daemon accepts; bigger jobs should pass paths.
+const uint64_t MAX_BYTES_REQUEST = 256ull * 1024 * 1024; // 256 MB
+const uint32_t MAX_PATH_LENGTH = 4096;
+
+// $XDG_RUNTIME_DIR/mtcompress.sock, or /tmp/mtcompress.sock without it.
+inline std::string defaultSocketPath() {
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    return std::string(runtime_dir && *runtime_dir ? runtime_dir : "/tmp") + "/mtcompress.sock";
+}
+
+// Reads exactly `size` bytes. Returns false on end of stream or error.
+inline bool readAll(int fd, void* data, size_t size) {
+    unsigned char* bytes = static_cast<unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Writes exactly `size` bytes without raising SIGPIPE if the peer has gone.
+inline bool writeAll(int fd, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Fills a sockaddr_un for `path`. Returns false if the path is too long.
+inline bool socketAddress(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Returns a connected socket, or -1 with `error` set.
+inline int connectTo(const std::string& path, std::string& error) {
+    sockaddr_un address;
+    if (!socketAddress(path, address)) {
+        error = "Socket path too long: " + path;
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        error = "Could not connect to " + path + ": " + std::strerror(errno);
+        if (fd >= 0) ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads a response. On STATUS_ERROR the payload is moved into `error`.
+inline bool readResponse(int fd, std::string& payload, std::string& error) {
+    uint8_t status;
+    uint64_t length;
+    if (!readAll(fd, &status, sizeof(status)) || !readAll(fd, &length, sizeof(length))) {
+        error = "Daemon closed the connection";
+        return false;
+    }
+    payload.resize(length);
+    if (length && !readAll(fd, &payload[0], length)) {
+        error = "Daemon closed the connection";
+        return false;
+    }
+    if (status != STATUS_OK) {
+        error = payload.empty() ? "Daemon reported an error" : payload;
+        return false;
+    }
+    return true;
+}
+
+// Asks the daemon at `socket_path` to run `op` from `input_path` to
+// `output_path`. Relative paths are resolved against the caller's directory.
+inline bool requestFiles(const std::string& socket_path, Op op, const std::string& input_path,
+                         const std::string& output_path, std::string& error) {
+    auto absolute = [](const std::string& path) {
+        if (!path.empty() && path[0] == '/') {
+            return path;
+        }
+        char cwd[PATH_MAX];
+        return ::getcwd(cwd, sizeof(cwd)) ? std::string(cwd) + "/" + path : path;
+    };
+    std::string input = absolute(input_path);
+    std::string output = absolute(output_path);
+    if (input.size() > MAX_PATH_LENGTH || output.size() > MAX_PATH_LENGTH) {
+        error = "Path too long";
+        return false;
+    }
+
+    int fd = connectTo(socket_path, error);
+    if (fd < 0) {
+        return false;
+    }
+    unsigned char header[REQUEST_HEADER_SIZE] = {};
+    std::memcpy(header, MAGIC, sizeof(MAGIC));
+    header[4] = op;
+    header[5] = SOURCE_PATHS;
+    uint32_t input_length = input.size();
+    uint32_t output_length = output.size();
+    bool sent = writeAll(fd, header, sizeof(header)) && writeAll(fd, &input_length, sizeof(input_length)) &&
+                writeAll(fd, input.data(), input.size()) && writeAll(fd, &output_length, sizeof(output_length)) &&
+                writeAll(fd, output.data(), output.size());
+    std::string payload;
+    bool ok = sent ? readResponse(fd, payload, error) : (error = "Could not send request", false);
+    ::close(fd);
+    return ok;
+}
+
+} // namespace daemon_protocol
@@ -2,110 +2,190 @@
 #include <fstream>
 #include <vector>
 #include <string>
-#include <cstdint>   // For uint32_t
-#include <stdexcept> // For std::runtime_error
-#include <zlib.h>    // Requires linking with -lz
+#include <memory>    // For std::unique_ptr
+#include <filesystem> // For std::filesystem::file_size
+#include "mtcompress.h"
+#include "daemon_protocol.h"
 
-// Define a constant for the chunk size.
-// This MUST match the CHUNK_SIZE used by the compressor to ensure
-// the decompression buffer is large enough.
-const size_t CHUNK_SIZE = 1024 * 1024; // 1 MB
-
-// Decompresses a vector of data using zlib's uncompress function.
-// It assumes the uncompressed data for a single chunk will not exceed CHUNK_SIZE.
-std::vector<unsigned char> decompressData(const std::vector<unsigned char>& input) {
-    if (input.empty()) {
-        return {};
-    }
-
-    // Create a destination buffer for the uncompressed data.
-    // We allocate a buffer of the original max chunk size.
-    std::vector<unsigned char> output(CHUNK_SIZE);
-    uLongf destLen = output.size();
-
-    // Perform the decompression.
-    // uncompress is a zlib function that decompresses a source buffer into a destination buffer.
-    int result = uncompress(output.data(), &destLen, input.data(), input.size());
-
-    if (result != Z_OK) {
-        // Handle potential errors. Z_BUF_ERROR might mean the destination buffer
-        // was too small, which shouldn't happen if CHUNK_SIZE is consistent.
-        // Other errors might indicate corrupt data.
-        throw std::runtime_error("Decompression failed with zlib error: " + std::to_string(result));
+int main(int argc, char* argv[]) {
+    // Separate the optional --stats flag from the two file arguments.
+    std::string stats_format; // "", "text" or "json".
+    bool show_progress = ProgressReporter::defaultEnabled();
+    bool perf_counters = false;
+    size_t threads = 0; // 0 sizes the pool from the affinity mask and cgroup quota.
+    std::string daemon_socket; // Hand the job to mtcompressd on this socket instead.
+    std::string local_option;  // The last option given that the daemon cannot honour.
+    bool list = false;         // Print an archive's file table instead of extracting.
+    std::string extract_path;  // Extract just this archived file to the output file.
+    std::string reference;     // The file the input was compressed against, if any.
+    std::string dictionary;    // The dictionary the input was compressed with, if any.
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        // The daemon decompresses with its own settings and only receives the two paths.
+        if (arg.size() > 1 && arg[0] == '-' && arg != "--daemon" && arg != "--progress" && arg != "--no-progress") {
+            local_option = arg;
+        }
+        if (arg == "--stats" || arg == "--stats=text" || arg == "--stats=json") {
+            stats_format = arg == "--stats=json" ? "json" : "text";
+        } else if (arg == "--perf-counters") {
+            perf_counters = true;
+        } else if (arg == "--progress" || arg == "--no-progress") {
+            show_progress = arg == "--progress";
+        } else if (arg == "--list") {
+            list = true;
+        } else if (arg == "--extract" && i + 1 < argc) {
+            extract_path = argv[++i];
+        } else if (arg == "--reference" && i + 1 < argc) {
+            reference = argv[++i];
+        } else if (arg == "--dict" && i + 1 < argc) {
+            dictionary = argv[++i];
+        } else if (arg == "--daemon" && i + 1 < argc) {
+            daemon_socket = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            std::string value = argv[++i];
+            try {
+                threads = std::stoul(value);
+            } catch (const std::exception&) {
+                threads = 0;
+            }
+            if (threads == 0) {
+                std::cerr << "Error: Invalid value for --threads: " << value << "\n";
+                return 1;
+            }
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Error: Unknown option " << arg << "\n";
+            return 1;
+        } else {
+            paths.push_back(arg);
+        }
     }
 
-    // Resize the output vector to the actual size of the decompressed data.
-    output.resize(destLen);
-    return output;
-}
-
-int main(int argc, char* argv[]) {
     // Check for the correct number of command-line arguments.
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <compressed_input_file> <output_file>\n";
+    if (paths.size() != (list ? 1u : 2u)) {
+        std::cerr << "Usage: " << argv[0] << " [--threads N] [--stats[=text|json]] [--perf-counters] [--[no-]progress] [--reference FILE] [--dict FILE] [--daemon SOCKET] <compressed_input_file> <output_file>\n";
+        std::cerr << "       " << argv[0] << " [options] <archive> <output_directory>\n";
+        std::cerr << "       " << argv[0] << " --list <archive>\n";
+        std::cerr << "       " << argv[0] << " --extract PATH <archive> <output_file>\n";
         std::cerr << "Example: " << argv[0] << " compressed.dat output.txt\n";
         return 1;
     }
 
     // Open the compressed input file in binary mode.
-    std::ifstream in(argv[1], std::ios::binary);
+    std::ifstream in(paths[0], std::ios::binary);
     if (!in) {
-        std::cerr << "Error: Could not open input file " << argv[1] << "\n";
+        std::cerr << "Error: Could not open input file " << paths[0] << "\n";
         return 1;
     }
+    bool archive = mtc::isArchive(in);
 
-    // Open the destination output file in binary mode.
-    std::ofstream out(argv[2], std::ios::binary);
-    if (!out) {
-        std::cerr << "Error: Could not open output file " << argv[2] << "\n";
-        return 1;
+    if (!daemon_socket.empty()) {
+        std::string error;
+        if (archive) {
+            std::cerr << "Error: --daemon decompresses single files, not archives\n";
+            return 1;
+        }
+        if (!local_option.empty()) {
+            std::cerr << "Error: --daemon decompresses with the daemon's own settings; " << local_option
+                      << " cannot be passed on\n";
+            return 1;
+        }
+        if (!daemon_protocol::requestFiles(daemon_socket, daemon_protocol::OP_DECOMPRESS, paths[0], paths[1], error)) {
+            std::cerr << "Error: " << error << '\n';
+            return 1;
+        }
+        std::cout << "File decompression successful. Output written to " << paths[1] << ".\n";
+        return 0;
     }
 
-    std::cout << "Starting decompression...\n";
-
-    // Loop through the file as long as we haven't reached the end.
-    // in.peek() checks the next character without extracting it.
-    while (in.peek() != EOF) {
-        // --- Step 1: Read the size of the next compressed chunk ---
-        uint32_t compressedChunkSize;
-        in.read(reinterpret_cast<char*>(&compressedChunkSize), sizeof(compressedChunkSize));
+    mtc::Options options;
+    options.perf_counters = perf_counters;
+    options.threads = threads;
+    options.reference = reference;
+    options.dictionary = dictionary;
 
-        // Check if we successfully read the size.
-        if (in.gcount() != sizeof(compressedChunkSize)) {
-            if (in.eof()) {
-                // This can happen if the file ends cleanly on a chunk boundary.
-                break; 
+    if (list) {
+        try {
+            for (const mtc::ArchiveEntry& entry : mtc::Decompressor(options).listFiles(in)) {
+                std::cout << std::oct << entry.mode << std::dec << '\t' << entry.size << '\t' << entry.path
+                          << (entry.directory ? "/" : "") << '\n';
             }
-            std::cerr << "Error: Failed to read chunk size. File may be corrupt.\n";
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << '\n';
             return 1;
         }
+        return 0;
+    }
 
-        // --- Step 2: Read the compressed chunk data ---
-        std::vector<unsigned char> compressedData(compressedChunkSize);
-        in.read(reinterpret_cast<char*>(compressedData.data()), compressedChunkSize);
+    // With --stats=json stdout carries nothing but the JSON report.
+    std::ostream null_stream(nullptr);
+    std::ostream& console = stats_format == "json" ? null_stream : std::cout;
 
-        if (in.gcount() != compressedChunkSize) {
-            std::cerr << "Error: Failed to read chunk data. File may be corrupt or truncated.\n";
+    // Open the destination output file in binary mode. An archive's second
+    // argument is the directory to extract into instead, unless extracting one file.
+    bool single_file = !extract_path.empty();
+    if (single_file && !archive) {
+        std::cerr << "Error: --extract needs an archive\n";
+        return 1;
+    }
+    std::ofstream out;
+    if (!archive || single_file) {
+        out.open(paths[1], std::ios::binary);
+        if (!out) {
+            std::cerr << "Error: Could not open output file " << paths[1] << "\n";
             return 1;
         }
+    }
 
-        // --- Step 3: Decompress the chunk ---
-        try {
-            std::vector<unsigned char> decompressedData = decompressData(compressedData);
-            
-            // --- Step 4: Write the decompressed data to the output file ---
-            out.write(reinterpret_cast<const char*>(decompressedData.data()), decompressedData.size());
-        } catch (const std::runtime_error& e) {
-            std::cerr << "An error occurred during decompression: " << e.what() << '\n';
-            return 1;
+    console << "Starting decompression...\n";
+
+    // Progress is measured in compressed bytes consumed, against the input file size.
+    std::unique_ptr<ProgressReporter> progress;
+    if (show_progress) {
+        std::error_code size_error;
+        uint64_t total_bytes = std::filesystem::file_size(paths[0], size_error);
+        progress = std::make_unique<ProgressReporter>(size_error ? 0 : total_bytes);
+        progress->start();
+    }
+
+    RunStats stats;
+    try {
+        if (single_file) {
+            mtc::Buffer data = mtc::Decompressor(options).extractFile(in, extract_path, &stats);
+            if (!out.write(reinterpret_cast<const char*>(data.data()), data.size())) {
+                throw std::runtime_error("Write failed");
+            }
+        } else if (archive) {
+            mtc::Decompressor(options).extractFiles(in, paths[1], &stats, progress.get());
+        } else {
+            mtc::Decompressor(options).decompress(in, out, &stats, progress.get());
         }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
     }
 
-    // Close the file streams.
+    // Close the file streams. Closing writes out whatever the output still
+    // buffers; extracting a whole archive never opened it.
     in.close();
-    out.close();
+    if (progress) {
+        progress->stop();
+    }
+    if (out.is_open()) {
+        out.close();
+        if (!out) {
+            std::cerr << "Error: Could not write output file " << paths[1] << "\n";
+            return 1;
+        }
+    }
 
-    std::cout << "File decompression successful. Output written to " << argv[2] << ".\n";
+    console << "File decompression successful. Output written to " << paths[1] << ".\n";
+
+    if (stats_format == "json") {
+        stats.writeJson(std::cout);
+    } else if (stats_format == "text") {
+        stats.writeText(std::cout);
+    }
 
     return 0;
 }
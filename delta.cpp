@@ -0,0 +1,185 @@
+#include "delta.h"
+#include <algorithm> // For std::min, std::max
+#include <cerrno>
+#include <cstring>   // For std::memcpy, std::strerror
+#include <fcntl.h>   // For open
+#include <stdexcept> // For std::runtime_error
+#include <sys/mman.h> // For mmap, madvise
+#include <sys/stat.h> // For fstat
+#include <unistd.h>   // For close
+#include <vector>
+#include "chunker.h"
+#include "codec.h"
+#include "dictionary.h"
+
+namespace {
+
+// The largest preset dictionary deflate can use.
+const size_t DICTIONARY_SIZE = 32 * 1024;
+
+// An anchor is where the top bits of the Gear hash are zero: about one every
+// 1 KB. The hash there covers the 64 bytes before it.
+const uint64_t ANCHOR_MASK = ~uint64_t(0) << (64 - 10);
+const size_t HASH_SPAN = 64;
+
+const size_t SEGMENT_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+// The dictionary a segment was compressed with: `offset` into the reference,
+// or with DELTA_OWN_HISTORY the chunk's own bytes before `done`.
+void segmentDictionary(const DeltaReference& reference, uint64_t offset, const unsigned char* chunk, size_t done,
+                       const unsigned char*& dictionary, size_t& dictionary_size) {
+    dictionary = nullptr;
+    dictionary_size = 0;
+    if (offset == DELTA_OWN_HISTORY) {
+        dictionary_size = std::min(DICTIONARY_SIZE, done);
+        dictionary = chunk + done - dictionary_size;
+    } else if (offset < reference.size()) {
+        dictionary = reference.data() + offset;
+        dictionary_size = std::min(DICTIONARY_SIZE, reference.size() - offset);
+    }
+}
+
+} // namespace
+
+DeltaReference::DeltaReference(const std::string& path, bool indexed) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open reference " + path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Could not stat reference " + path + ": " + std::strerror(errno));
+    }
+    length = st.st_size;
+    if (length > 0) {
+        void* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Could not map reference " + path + ": " + std::strerror(errno));
+        }
+        contents = static_cast<const unsigned char*>(mapped);
+    }
+    ::close(fd);
+
+    // Read it front to back once now; later accesses jump around.
+    if (length > 0) {
+        ::madvise(const_cast<unsigned char*>(contents), length, MADV_WILLNEED);
+    }
+    checksum = dictionaryId(contents, length);
+    if (indexed) {
+        anchors.reserve(length >> 10);
+        uint64_t hash = 0;
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash << 1) + GEAR_TABLE[contents[i]];
+            if (i + 1 >= HASH_SPAN && !(hash & ANCHOR_MASK)) {
+                anchors.emplace(hash, i + 1);
+            }
+        }
+    }
+}
+
+DeltaReference::~DeltaReference() {
+    if (contents) {
+        ::munmap(const_cast<unsigned char*>(contents), length);
+    }
+}
+
+bool DeltaReference::locate(const unsigned char* data, size_t size, int64_t& offset) const {
+    // Each anchor found in the reference votes for the alignment it implies.
+    // Kept per thread so steady-state use does no allocation.
+    thread_local std::vector<std::pair<int64_t, size_t>> votes;
+    votes.clear();
+    uint64_t hash = 0;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash << 1) + GEAR_TABLE[data[i]];
+        if (i + 1 < HASH_SPAN || (hash & ANCHOR_MASK)) {
+            continue;
+        }
+        auto found = anchors.find(hash);
+        if (found == anchors.end()) {
+            continue;
+        }
+        int64_t start = int64_t(found->second) - int64_t(i + 1);
+        auto vote = std::find_if(votes.begin(), votes.end(), [start](const auto& v) { return v.first == start; });
+        if (vote == votes.end()) {
+            votes.emplace_back(start, 1);
+        } else {
+            ++vote->second;
+        }
+    }
+    if (votes.empty()) {
+        return false;
+    }
+    offset = std::max_element(votes.begin(), votes.end(),
+                              [](const auto& a, const auto& b) { return a.second < b.second; })->first;
+    return true;
+}
+
+size_t deltaBound(size_t size) {
+    // Per segment: its header plus zlib's own bound.
+    size_t segments = size / DELTA_SEGMENT_SIZE + 1;
+    return compressBound(size) + segments * (SEGMENT_HEADER_SIZE + 32);
+}
+
+size_t compressDelta(const DeltaReference& reference, uint64_t position, const unsigned char* input, size_t size,
+                     unsigned char* output, size_t capacity, int level) {
+    size_t written = 0;
+    int64_t shift = 0; // Reference offset minus input position, carried between segments.
+    for (size_t done = 0; done < size;) {
+        size_t n = std::min(size - done, DELTA_SEGMENT_SIZE);
+        int64_t start;
+        uint64_t dictionary_offset;
+        if (reference.locate(input + done, n, start)) {
+            shift = start - int64_t(position + done);
+            dictionary_offset = std::max<int64_t>(0, start - int64_t(DELTA_SLACK));
+        } else if (done > 0) {
+            // New content: it most likely resembles what came just before it.
+            dictionary_offset = DELTA_OWN_HISTORY;
+        } else {
+            int64_t aligned = int64_t(position) + shift;
+            dictionary_offset = std::max<int64_t>(0, aligned - int64_t(DELTA_SLACK));
+        }
+        const unsigned char* dictionary;
+        size_t dictionary_size;
+        segmentDictionary(reference, dictionary_offset, input, done, dictionary, dictionary_size);
+
+        if (capacity - written < SEGMENT_HEADER_SIZE + compressBound(n)) {
+            throw std::runtime_error("Delta output exceeds its bound");
+        }
+        unsigned char* header = output + written;
+        uint32_t compressed = compressBytes(input + done, n, header + SEGMENT_HEADER_SIZE,
+                                            capacity - written - SEGMENT_HEADER_SIZE, level, false, dictionary,
+                                            dictionary_size);
+        std::memcpy(header, &dictionary_offset, sizeof(dictionary_offset));
+        std::memcpy(header + sizeof(dictionary_offset), &compressed, sizeof(compressed));
+        written += SEGMENT_HEADER_SIZE + compressed;
+        done += n;
+    }
+    return written;
+}
+
+size_t decompressDelta(const DeltaReference& reference, const unsigned char* input, size_t size,
+                       unsigned char* output, size_t capacity) {
+    size_t produced = 0;
+    for (size_t offset = 0; offset < size;) {
+        uint64_t dictionary_offset;
+        uint32_t compressed;
+        if (size - offset < SEGMENT_HEADER_SIZE) {
+            throw std::runtime_error("Truncated delta segment");
+        }
+        std::memcpy(&dictionary_offset, input + offset, sizeof(dictionary_offset));
+        std::memcpy(&compressed, input + offset + sizeof(dictionary_offset), sizeof(compressed));
+        offset += SEGMENT_HEADER_SIZE;
+        if (compressed > size - offset) {
+            throw std::runtime_error("Truncated delta segment");
+        }
+        const unsigned char* dictionary;
+        size_t dictionary_size;
+        segmentDictionary(reference, dictionary_offset, output, produced, dictionary, dictionary_size);
+        produced += decompressBytes(input + offset, compressed, output + produced, capacity - produced, dictionary,
+                                    dictionary_size);
+        offset += compressed;
+    }
+    return produced;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// Delta compression against a reference file, typically an older version of
+// the same data.
+//
+// Deflate can only refer back 32 KB, so a chunk is compressed in segments of
+// DELTA_SEGMENT_SIZE bytes, each its own zlib stream primed with the 32 KB of
+// the reference around where that segment's content sits there. The segment is
+// then mostly matches into the reference. To find that spot, the reference is
+// indexed at content-defined anchors (Gear hash, as in chunker.h) and each
+// segment votes with its own anchors, so content that moved is still found. A
+// segment with no anchor in the reference is new content and is primed with
+// the chunk's own preceding 32 KB instead, as plain deflate would have it.
+// Each segment records where its dictionary came from, so decoding needs no
+// index.
+//
+// A delta chunk is a sequence of segments:
+//
+//   uint64_t dictionary_offset       (into the reference, past its end for none,
+//                                     or DELTA_OWN_HISTORY)
+//   uint32_t compressed_size
+//   compressed_size bytes of zlib data
+
+const size_t DELTA_SEGMENT_SIZE = 16 * 1024;
+
+// Up to this much of the reference before the aligned position goes into the
+// dictionary, so content shifted either way by up to this much still matches.
+const size_t DELTA_SLACK = 8 * 1024;
+
+// Dictionary offset of a segment primed with the preceding bytes of its chunk.
+const uint64_t DELTA_OWN_HISTORY = UINT64_MAX;
+
+// A reference file, mapped read-only.
+class DeltaReference {
+public:
+    // Maps `path`. With `indexed`, also indexes anchors for compressDelta();
+    // decoding does not need them.
+    DeltaReference(const std::string& path, bool indexed);
+    ~DeltaReference();
+
+    DeltaReference(const DeltaReference&) = delete;
+    DeltaReference& operator=(const DeltaReference&) = delete;
+
+    const unsigned char* data() const { return contents; }
+    size_t size() const { return length; }
+
+    // Checksum of the contents, recorded in the container header so a file is
+    // not decoded against the wrong reference.
+    uint32_t id() const { return checksum; }
+
+    // Where the content at `data` most likely starts in the reference, voted on
+    // by the anchors in it. Returns false if none of them occur there.
+    bool locate(const unsigned char* data, size_t size, int64_t& offset) const;
+
+private:
+    const unsigned char* contents = nullptr;
+    size_t length = 0;
+    uint32_t checksum = 0;
+    std::unordered_map<uint64_t, uint64_t> anchors; // Gear hash at an anchor -> first offset just past it.
+};
+
+// Upper bound on the size of a delta chunk of `size` bytes.
+size_t deltaBound(size_t size);
+
+// Compresses `size` bytes at uncompressed `position` against `reference`.
+// Returns the compressed size; `capacity` must be at least deltaBound(size).
+size_t compressDelta(const DeltaReference& reference, uint64_t position, const unsigned char* input, size_t size,
+                     unsigned char* output, size_t capacity, int level);
+
+// Decodes a delta chunk and returns its uncompressed size. Throws on corrupt
+// data or if it does not fit in `capacity`.
+size_t decompressDelta(const DeltaReference& reference, const unsigned char* input, size_t size,
+                       unsigned char* output, size_t capacity);
@@ -0,0 +1,131 @@
+#include "dictionary.h"
+#include <algorithm> // For std::min, std::max
+#include <cstring>   // For std::memcpy
+#include "chunk_hash.h"
+
+namespace {
+
+const size_t DMER_SIZE = 8;       // Length of the substrings counted.
+const size_t SEGMENT_SIZE = 1024; // Bytes taken into the dictionary at a time.
+
+// Substrings are counted in a table indexed by their hash; collisions only
+// blur the scores a little.
+const int TABLE_BITS = 20;
+
+size_t dmerIndex(const unsigned char* data) {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return (value * xxh64::PRIME1) >> (64 - TABLE_BITS);
+}
+
+// A run of substring start positions [begin, end) and its score.
+struct Segment {
+    size_t begin = 0;
+    size_t end = 0;
+    uint64_t score = 0;
+};
+
+class Trainer {
+public:
+    explicit Trainer(const std::vector<unsigned char>& corpus)
+        : corpus(corpus), frequencies(size_t(1) << TABLE_BITS), active_counts(size_t(1) << TABLE_BITS) {
+        for (size_t i = 0; i < positions(); ++i)
+            ++frequencies[dmerIndex(corpus.data() + i)];
+    }
+
+    // Substring start positions in the corpus.
+    size_t positions() const { return corpus.size() < DMER_SIZE ? 0 : corpus.size() - DMER_SIZE + 1; }
+
+    // The best segment starting in [begin, end), trimmed of substrings that no
+    // longer count. Its substrings stop counting for later segments.
+    Segment select(size_t begin, size_t end) {
+        const size_t window = SEGMENT_SIZE - DMER_SIZE + 1;
+        Segment best{begin, begin, 0};
+        Segment active{begin, begin, 0};
+        // Slide a window of `window` positions, scoring each distinct substring once.
+        while (active.end < end) {
+            size_t added = dmerIndex(corpus.data() + active.end);
+            if (active_counts[added]++ == 0) {
+                active.score += frequencies[added];
+            }
+            ++active.end;
+            if (active.end - active.begin > window) {
+                size_t removed = dmerIndex(corpus.data() + active.begin);
+                if (--active_counts[removed] == 0) {
+                    active.score -= frequencies[removed];
+                }
+                ++active.begin;
+            }
+            if (active.score > best.score) {
+                best = active;
+            }
+        }
+        for (; active.begin < active.end; ++active.begin)
+            active_counts[dmerIndex(corpus.data() + active.begin)] = 0;
+
+        size_t first = best.end;
+        size_t last = best.begin;
+        for (size_t i = best.begin; i < best.end; ++i) {
+            size_t index = dmerIndex(corpus.data() + i);
+            if (frequencies[index] != 0) {
+                first = std::min(first, i);
+                last = i + 1;
+            }
+        }
+        best.begin = first;
+        best.end = std::max(first, last);
+        for (size_t i = best.begin; i < best.end; ++i)
+            frequencies[dmerIndex(corpus.data() + i)] = 0;
+        return best;
+    }
+
+private:
+    const std::vector<unsigned char>& corpus;
+    std::vector<uint32_t> frequencies;   // Occurrences of each substring that still counts.
+    std::vector<uint16_t> active_counts; // Occurrences of each substring in the sliding window.
+};
+
+} // namespace
+
+std::vector<unsigned char> trainDictionary(const std::vector<std::vector<unsigned char>>& samples, size_t size) {
+    std::vector<unsigned char> corpus;
+    for (const auto& sample : samples)
+        corpus.insert(corpus.end(), sample.begin(), sample.end());
+    size = std::min(size, MAX_DICTIONARY_SIZE);
+    Trainer trainer(corpus);
+    size_t positions = trainer.positions();
+    if (positions == 0 || size == 0) {
+        return {};
+    }
+
+    // One segment per epoch per pass, so every part of the samples gets a say.
+    size_t epochs = std::max<size_t>(1, size / SEGMENT_SIZE);
+    if (positions / epochs < SEGMENT_SIZE) {
+        epochs = std::max<size_t>(1, positions / SEGMENT_SIZE);
+    }
+    size_t epoch_size = positions / epochs;
+
+    // Filled from the back, so the best segments end up last.
+    std::vector<unsigned char> dictionary(size);
+    size_t tail = size;
+    size_t empty_epochs = 0; // Consecutive epochs with nothing left to give.
+    for (size_t epoch = 0; tail > 0 && empty_epochs < epochs; epoch = (epoch + 1) % epochs) {
+        size_t begin = epoch * epoch_size;
+        size_t end = epoch + 1 == epochs ? positions : begin + epoch_size;
+        Segment segment = trainer.select(begin, end);
+        if (segment.score == 0) {
+            ++empty_epochs;
+            continue;
+        }
+        empty_epochs = 0;
+        size_t n = std::min(segment.end - segment.begin + DMER_SIZE - 1, tail);
+        tail -= n;
+        std::memcpy(dictionary.data() + tail, corpus.data() + segment.begin, n);
+    }
+    dictionary.erase(dictionary.begin(), dictionary.begin() + tail);
+    return dictionary;
+}
+
+uint32_t dictionaryId(const unsigned char* data, size_t size) {
+    return static_cast<uint32_t>(xxh64::hash(data, size, 0));
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Preset dictionaries for small chunks.
+//
+// Every chunk is its own zlib stream and starts with an empty window, so
+// small chunks compress poorly: the strings they have in common with each
+// other are never in view. A dictionary trained on typical chunks fills the
+// window with those strings before each chunk is compressed and again before
+// it is inflated. Deflate only uses the last 32 KB of a dictionary.
+
+const size_t MAX_DICTIONARY_SIZE = 32 * 1024;
+
+// Builds a dictionary of at most `size` bytes out of the pieces of `samples`
+// that contain the most common substrings, as zstd's FastCOVER trainer does:
+// the samples are split into epochs and each epoch in turn contributes its
+// best 1 KB segment, scored by how often its 8-byte substrings occur across all
+// samples, until the dictionary is full. Substrings already taken stop
+// counting. The best segments go last, where deflate reaches them with the
+// shortest distances. Samples should be whole chunks of the data to compress;
+// a hundred times `size` of them is plenty. Returns less than `size` if the
+// samples run out of repeated content, and nothing if they have none.
+std::vector<unsigned char> trainDictionary(const std::vector<std::vector<unsigned char>>& samples, size_t size);
+
+// Identifies a dictionary, or a delta reference, in the container header.
+uint32_t dictionaryId(const unsigned char* data, size_t size);
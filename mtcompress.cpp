@@ -0,0 +1,2134 @@
+#include "mtcompress.h"
+#include <algorithm> // For std::max, std::find, std::sort, std::unique
+#include <condition_variable>
+#include <cerrno>
+#include <cstring>   // For std::memcpy, std::strerror
+#include <fcntl.h>   // For AT_FDCWD, open
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept> // For std::runtime_error
+#include <string>
+#include <sys/stat.h> // For stat, chmod, utimensat
+#include <unistd.h>   // For unlink, pread, copy_file_range
+#include <unordered_map>
+#include <zlib.h>    // Requires linking with -lz
+#include "chunk_hash.h"
+#include "chunker.h"
+#include "codec.h"
+#include "delta.h"
+#include "dictionary.h"
+#include "thread_pool.h"
+#include "topology.h"
+#include "trace.h"
+
+namespace mtc {
+
+namespace {
+
+// Pulls up to `size` bytes into `data` for one chunk. A short read ends the
+// chunk early; 0 means the input is exhausted.
+using ReadFn = std::function<size_t(unsigned char* data, size_t size)>;
+
+// Reads exactly `size` bytes at `offset` from the start of the container, or
+// throws. Lets the decompressor follow dedup references back into the input.
+using FetchFn = std::function<void(uint64_t offset, unsigned char* data, size_t size)>;
+
+ReadFn streamReader(std::istream& in) {
+    return [&in](unsigned char* data, size_t size) -> size_t {
+        in.read(reinterpret_cast<char*>(data), size);
+        if (in.bad()) {
+            throw std::runtime_error("Read failed");
+        }
+        return in.gcount();
+    };
+}
+
+// Positional reads from a seekable stream whose container starts at `start`.
+// The read position is restored afterwards. Unset if `in` cannot seek.
+FetchFn streamFetcher(std::istream& in, std::streampos start) {
+    if (start == std::streampos(-1)) {
+        return nullptr;
+    }
+    return [&in, start](uint64_t offset, unsigned char* data, size_t size) {
+        std::streampos resume = in.tellg();
+        in.seekg(start + std::streamoff(offset));
+        bool complete = static_cast<bool>(in.read(reinterpret_cast<char*>(data), size));
+        in.clear();
+        in.seekg(resume);
+        if (!complete) {
+            throw std::runtime_error("Failed to read duplicated chunk. File may be corrupt or truncated.");
+        }
+    };
+}
+
+Sink streamWriter(std::ostream& out) {
+    return [&out](const unsigned char* data, size_t size) {
+        if (!out.write(reinterpret_cast<const char*>(data), size)) {
+            throw std::runtime_error("Write failed");
+        }
+    };
+}
+
+// Pushes out what the stream still buffers, so a failure to write the tail of
+// the output throws like any other write.
+void flushStream(std::ostream& out) {
+    if (!out.flush()) {
+        throw std::runtime_error("Write failed");
+    }
+}
+
+ReadFn memoryReader(const unsigned char* data, size_t size) {
+    size_t offset = 0;
+    return [data, size, offset](unsigned char* dest, size_t wanted) mutable -> size_t {
+        size_t n = std::min(wanted, size - offset);
+        if (n == 0) {
+            return n; // `data` may be null for an empty input.
+        }
+        std::memcpy(dest, data + offset, n);
+        offset += n;
+        return n;
+    };
+}
+
+FetchFn memoryFetcher(const unsigned char* data, size_t size) {
+    return [data, size](uint64_t offset, unsigned char* dest, size_t wanted) {
+        if (offset > size || wanted > size - offset) {
+            throw std::runtime_error("Failed to read duplicated chunk. File may be corrupt or truncated.");
+        }
+        std::memcpy(dest, data + offset, wanted);
+    };
+}
+
+Sink memoryWriter(Buffer& buffer) {
+    return [&buffer](const unsigned char* data, size_t size) { buffer.insert(buffer.end(), data, data + size); };
+}
+
+// Reads the part of a dictionary file deflate can use: its last 32 KB.
+Buffer readDictionary(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        throw std::runtime_error("Could not open dictionary " + path);
+    }
+    std::streamoff size = in.tellg();
+    std::streamoff skip = std::max<std::streamoff>(0, size - std::streamoff(MAX_DICTIONARY_SIZE));
+    Buffer data(size - skip);
+    in.seekg(skip);
+    if (!in.read(reinterpret_cast<char*>(data.data()), data.size())) {
+        throw std::runtime_error("Could not read dictionary " + path);
+    }
+    if (data.empty()) {
+        throw std::runtime_error("Dictionary " + path + " is empty");
+    }
+    return data;
+}
+
+// The CPUs of `requested` that workers may be pinned to. Throws if there are
+// none, rather than sizing and pinning the pool to CPUs it cannot run on.
+std::vector<int> usableCpus(const std::vector<int>& requested) {
+    if (requested.empty()) {
+        return requested;
+    }
+    std::vector<int> cpus = allowedSubset(requested);
+    if (cpus.empty()) {
+        throw std::runtime_error("None of the requested CPUs are available to this process");
+    }
+    return cpus;
+}
+
+// Ends each chunk at a content-defined boundary instead of after a fixed count.
+// Input is staged so every cut can look a whole maximum chunk ahead; staging
+// holds two maximum chunks and is compacted only once less than one is left,
+// so the data is copied at most twice on its way to the chunk buffers.
+ReadFn contentDefinedReader(ReadFn source, const ContentDefinedChunker& chunker) {
+    struct State {
+        ContentDefinedChunker chunker;
+        Buffer staging;
+        size_t begin = 0; // Unconsumed input is staging[begin, end).
+        size_t end = 0;
+        bool exhausted = false;
+    };
+    auto state = std::make_shared<State>(State{chunker, Buffer(chunker.maxSize() * 2)});
+    return [source = std::move(source), state](unsigned char* data, size_t size) -> size_t {
+        State& s = *state;
+        size_t limit = std::min(size, s.chunker.maxSize());
+        if (s.end - s.begin < limit && !s.exhausted) {
+            std::memmove(s.staging.data(), s.staging.data() + s.begin, s.end - s.begin);
+            s.end -= s.begin;
+            s.begin = 0;
+            while (s.end < limit && !s.exhausted) {
+                size_t n = source(s.staging.data() + s.end, s.staging.size() - s.end);
+                s.exhausted = n == 0;
+                s.end += n;
+            }
+        }
+        size_t n = s.chunker.findBoundary(s.staging.data() + s.begin, std::min(s.end - s.begin, limit));
+        std::memcpy(data, s.staging.data() + s.begin, n);
+        s.begin += n;
+        return n;
+    };
+}
+
+template <typename T>
+void appendValue(Buffer& out, T value) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+// Where one chunk's compressed bytes live, and what they hold: an entry of a
+// chunk index (see FLAG_CHUNK_INDEX).
+struct IndexEntry {
+    uint64_t data_offset = 0;
+    uint32_t compressed_size = 0;
+    uint32_t raw_size = 0;
+    ChunkDigest digest;
+};
+
+// A compressed or decompressed chunk as returned by a worker, with what it cost.
+struct ChunkResult {
+    PooledBuffer data;
+    uint32_t raw_size = 0;       // Uncompressed bytes, filled in by the compressor.
+    bool duplicate = false;      // With dedup: not compressed, `original` holds the same bytes.
+    size_t original = 0;
+    const IndexEntry* reused = nullptr; // Not compressed: copy this chunk of the base instead.
+    ChunkDigest digest;          // Of the uncompressed bytes, when dedup, indexing or a base needs it.
+    int level = 0;               // zlib level the compressor used.
+    double seconds = 0;
+    CounterValues counters;      // Hardware counters around the codec call, with perf_counters.
+    bool counters_valid = false;
+};
+
+// Runs `codec` from `input` into a buffer from `output_pool`, timing it and, if
+// `count_perf`, sampling this worker's hardware counters around it.
+template <typename Codec>
+ChunkResult runCodec(Codec codec, const PooledBuffer& input, BufferPool& output_pool, bool count_perf) {
+    auto start = Clock::now();
+    ChunkResult result;
+    result.data = output_pool.acquire();
+    if (count_perf) {
+        // One counter group per worker thread, opened on first use.
+        thread_local PerfCounters perf;
+        CounterValues before = perf.read();
+        codec(input, result.data);
+        result.counters = perf.read() - before;
+        result.counters_valid = perf.available();
+    } else {
+        codec(input, result.data);
+    }
+    result.seconds = secondsSince(start);
+    return result;
+}
+
+// Adds one chunk's worker time and counters to the run totals.
+void addChunkStats(RunStats& stats, PhaseStats& phase, const ChunkResult& result) {
+    stats.chunk_seconds.push_back(result.seconds);
+    phase.seconds += result.seconds;
+    if (result.counters_valid) {
+        stats.counters += result.counters;
+        stats.perf_available = true;
+    }
+}
+
+// The workers belonging to one NUMA node. Outside NUMA mode there is a single
+// node holding every worker. All jobs share them.
+struct NodeContext {
+    std::vector<int> cpus;
+    size_t threads = 0;
+    std::unique_ptr<ThreadPool> workers;
+};
+
+// The chunk buffers of one running job: an input and an output pool per node,
+// each holding that node's share of the window. A job that owns its buffers
+// cannot be stalled by another job sitting on them.
+struct Lane {
+    std::vector<std::unique_ptr<BufferPool>> input_pools;
+    std::vector<std::unique_ptr<BufferPool>> output_pools;
+};
+
+// One job's chunks by content, for dedup. Workers look up each chunk before
+// compressing it, so a repeat costs a hash instead of a deflate.
+class DedupTable {
+public:
+    // Returns the id of an earlier chunk with the same digest, or `id` itself
+    // if this chunk has to be compressed. Chunks finish out of order: if a
+    // later copy got here first, both are compressed and this one becomes the
+    // one that further copies refer to.
+    size_t claim(const ChunkDigest& digest, size_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = first.emplace(digest, id);
+        if (!inserted && it->second > id) {
+            it->second = id;
+        }
+        return it->second;
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<ChunkDigest, size_t, ChunkDigestHash> first;
+};
+
+// The chunks of an earlier container by content, for compressIncremental(),
+// and how to copy one's compressed bytes to the output being written.
+struct BaseContainer {
+    std::unordered_map<ChunkDigest, IndexEntry, ChunkDigestHash> chunks;
+    std::function<void(const IndexEntry& chunk)> copy;
+};
+
+} // namespace
+
+struct Compressor::Impl {
+    Options options;
+    ContentDefinedChunker chunker;
+    size_t max_chunk_size = 0; // Largest chunk: chunk_size, or the chunker's bound.
+    std::unique_ptr<DeltaReference> reference; // Set if options.reference is.
+    Buffer dictionary;                         // Contents of options.dictionary, if set.
+    uint32_t dictionary_id = 0;                // For the header: the reference's or the dictionary's.
+    size_t total_threads = 0;
+    size_t per_node_window = 0;
+    std::vector<NodeContext> nodes;
+
+    // Lanes are created on demand up to options.max_jobs and reused by later jobs.
+    std::mutex lanes_mutex;
+    std::condition_variable lane_released;
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::vector<Lane*> idle_lanes;
+
+    explicit Impl(const Options& options);
+    ~Impl();
+
+    // Checks out a lane for one job, waiting while max_jobs jobs are running.
+    Lane& acquireLane();
+    void releaseLane(Lane& lane);
+    std::unique_ptr<Lane> createLane() const;
+
+    // `flags` go into the header; `chunk_offsets` and `base` are passed to the ChunkPipeline.
+    void run(const ReadFn& read, const Sink& write, RunStats& stats, ProgressReporter* progress,
+             uint16_t flags = 0, std::vector<uint64_t>* chunk_offsets = nullptr,
+             const BaseContainer* base = nullptr);
+
+    // Resets `stats` for a new job and writes the container header. Returns the
+    // read phase, added first so phases are listed in pipeline order.
+    PhaseStats& beginJob(const Sink& write, RunStats& stats, uint16_t flags = 0) const;
+
+    // The header flags of a job started with `flags`, adding the options' own.
+    uint16_t jobFlags(uint16_t flags) const;
+
+    // Fills in the job totals once its pipeline has drained.
+    void endJob(RunStats& stats, size_t chunks, Clock::time_point start) const;
+
+    // Applies the chunking mode to a plain input.
+    ReadFn chunkReader(ReadFn source) const;
+};
+
+Compressor::Impl::Impl(const Options& opts) : options(opts), chunker(opts.chunk_size) {
+    max_chunk_size = options.content_defined ? chunker.maxSize() : options.chunk_size;
+    if (options.chunk_size == 0 || max_chunk_size > MAX_CHUNK_SIZE) {
+        throw std::runtime_error("Invalid chunk size " + std::to_string(options.chunk_size));
+    }
+    if (options.max_jobs == 0) {
+        throw std::runtime_error("max_jobs must be at least 1");
+    }
+    if (options.level < Z_DEFAULT_COMPRESSION || options.level > Z_BEST_COMPRESSION) {
+        throw std::runtime_error("Invalid compression level " + std::to_string(options.level));
+    }
+    if (options.target_mbps < 0) {
+        throw std::runtime_error("Invalid throughput target " + std::to_string(options.target_mbps));
+    }
+    options.cpus = usableCpus(options.cpus);
+    if (!options.reference.empty()) {
+        if (options.rsyncable) {
+            // Delta segments already restart every DELTA_SEGMENT_SIZE bytes, aligned to the reference instead.
+            throw std::runtime_error("A reference cannot be combined with rsyncable output");
+        }
+        if (!options.dictionary.empty()) {
+            throw std::runtime_error("A reference cannot be combined with a dictionary");
+        }
+        reference = std::make_unique<DeltaReference>(options.reference, true);
+        dictionary_id = reference->id();
+    }
+    if (!options.dictionary.empty()) {
+        dictionary = readDictionary(options.dictionary);
+        dictionary_id = dictionaryId(dictionary.data(), dictionary.size());
+    }
+
+    // At most `window` chunks are in flight at once. Input and output buffers come
+    // from fixed pools of that size and are recycled, so steady-state operation
+    // does no per-chunk heap allocation regardless of the input size.
+    // Size the pool from the CPUs we may actually use: an explicit cpus list, or
+    // the affinity mask, capped by any cgroup CPU quota when threads is not given.
+    std::vector<int> allowed = options.cpus.empty() ? allowedCpus() : options.cpus;
+    total_threads = options.threads ? options.threads : defaultThreadCount(allowed);
+
+    // Each entry is the CPU set of one worker group.
+    std::vector<std::vector<int>> node_cpus;
+    if (options.numa) {
+        for (const auto& cpus : numaNodeCpus()) {
+            std::vector<int> usable;
+            for (int cpu : cpus)
+                if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) usable.push_back(cpu);
+            if (!usable.empty()) {
+                node_cpus.push_back(std::move(usable));
+            }
+        }
+        if (node_cpus.size() < 2) {
+            // Only one node: run without NUMA placement.
+            node_cpus.clear();
+        }
+    }
+    if (node_cpus.empty()) {
+        // A single group, pinned only if the caller asked for specific CPUs.
+        node_cpus.push_back(options.cpus);
+    }
+
+    // Workers are split across groups in proportion to each group's CPU count.
+    size_t node_count = node_cpus.size();
+    size_t total_cpus = 0;
+    for (const auto& cpus : node_cpus)
+        total_cpus += cpus.size();
+
+    nodes.resize(node_count);
+    for (size_t n = 0; n < node_count; ++n) {
+        nodes[n].cpus = node_cpus[n];
+        nodes[n].threads = node_count == 1 ? total_threads
+                                           : std::max<size_t>(1, total_threads * node_cpus[n].size() / total_cpus);
+        per_node_window = std::max(per_node_window, nodes[n].threads * 2);
+    }
+
+    for (NodeContext& node : nodes)
+        node.workers = std::make_unique<ThreadPool>(node.threads, node.cpus);
+
+    // The first lane is built up front so a single job never waits on mmap.
+    lanes.push_back(createLane());
+    idle_lanes.push_back(lanes.back().get());
+}
+
+std::unique_ptr<Lane> Compressor::Impl::createLane() const {
+    auto lane = std::make_unique<Lane>();
+    for (const NodeContext& node : nodes) {
+        auto input_pool = std::make_unique<BufferPool>(max_chunk_size, per_node_window, options.huge_pages);
+        size_t output_size = reference ? deltaBound(max_chunk_size) : compressedBound(max_chunk_size, options.rsyncable);
+        auto output_pool = std::make_unique<BufferPool>(output_size, per_node_window, options.huge_pages);
+        if (!node.cpus.empty()) {
+            // First-touch the buffers from the CPUs that will compress them.
+            runOnCpus(node.cpus, [&input_pool, &output_pool] {
+                input_pool->prefault();
+                output_pool->prefault();
+            });
+        }
+        lane->input_pools.push_back(std::move(input_pool));
+        lane->output_pools.push_back(std::move(output_pool));
+    }
+    return lane;
+}
+
+Lane& Compressor::Impl::acquireLane() {
+    std::unique_lock<std::mutex> lock(lanes_mutex);
+    if (idle_lanes.empty() && lanes.size() < options.max_jobs) {
+        lanes.push_back(createLane());
+        return *lanes.back();
+    }
+    lane_released.wait(lock, [this] { return !idle_lanes.empty(); });
+    Lane* lane = idle_lanes.back();
+    idle_lanes.pop_back();
+    return *lane;
+}
+
+void Compressor::Impl::releaseLane(Lane& lane) {
+    {
+        std::lock_guard<std::mutex> lock(lanes_mutex);
+        idle_lanes.push_back(&lane);
+    }
+    lane_released.notify_one();
+}
+
+Compressor::Impl::~Impl() {
+    // Stops every worker group, waiting for queued tasks to finish.
+    for (auto& node : nodes)
+        node.workers->shutdown();
+}
+
+namespace {
+
+// Holds a lane for the duration of a job.
+class LaneLease {
+public:
+    explicit LaneLease(Compressor::Impl& engine) : engine(engine), held(&engine.acquireLane()) {}
+    ~LaneLease() { release(); }
+
+    LaneLease(const LaneLease&) = delete;
+    LaneLease& operator=(const LaneLease&) = delete;
+
+    Lane& lane() { return *held; }
+
+    void release() {
+        if (held) {
+            engine.releaseLane(*held);
+            held = nullptr;
+        }
+    }
+
+private:
+    Compressor::Impl& engine;
+    Lane* held;
+};
+
+// Picks the level of each chunk for Options::target_mbps: the highest one
+// whose speed, measured per level on the chunks compressed at it and scaled to
+// all workers, keeps up with the target. Workers shared with other jobs run
+// slower than that, so if the writer waits on them while the job is below
+// target the level drops as well. A whole window of chunks is always in
+// flight, so after each one-level step the next waits for chunks at the new
+// level to be written. Speeds drift with the data and the machine's load, so
+// a level not measured in the last COST_LIFETIME chunks is tried again rather
+// than trusted.
+class LevelController {
+public:
+    LevelController(double target, size_t workers) : target(target), workers(workers), mark(Clock::now()) {}
+
+    int level() const { return current; }
+
+    // Records a chunk of `bytes` compressed at `level` in `seconds` of worker
+    // time, and whether the writer had to wait for it.
+    void record(int level, size_t bytes, double seconds, bool waited) {
+        if (bytes > 0 && seconds > 0) {
+            double cost = seconds / bytes;
+            costs[level] = known(level) ? costs[level] * 0.75 + cost * 0.25 : cost;
+            measured[level] = recorded;
+        }
+        ++recorded;
+        written += bytes;
+        double elapsed = secondsSince(mark);
+        if (elapsed >= RATE_INTERVAL) {
+            rate = written / elapsed;
+            restartRate();
+        }
+        if (level != current || ++settled < SETTLE_CHUNKS) {
+            return;
+        }
+        bool behind = waited && rate > 0 && rate < target;
+        if ((behind || capacity(current) < target) && current > 0) {
+            step(-1);
+        } else if (!behind && current < Z_BEST_COMPRESSION) {
+            // Levels not tried yet are assumed to be a good deal slower.
+            double next = known(current + 1) ? capacity(current + 1) : capacity(current) / 1.5;
+            if (next >= target * HEADROOM) {
+                step(1);
+            }
+        }
+    }
+
+private:
+    static constexpr double RATE_INTERVAL = 0.5; // Seconds the job's rate is measured over.
+    static constexpr int SETTLE_CHUNKS = 2;      // Chunks written at a new level before the next step.
+    static constexpr double HEADROOM = 1.15;     // Margin a higher level must leave over the target.
+    static constexpr uint64_t COST_LIFETIME = 32; // Chunks a level's measured speed is trusted for.
+
+    double target; // Bytes per second.
+    size_t workers;
+    double costs[Z_BEST_COMPRESSION + 1] = {}; // Worker seconds per byte at each level; 0 if not measured.
+    uint64_t measured[Z_BEST_COMPRESSION + 1] = {}; // Chunk count when each level's cost was last updated.
+    uint64_t recorded = 0;                           // Chunks recorded so far.
+    int current = Z_BEST_SPEED;
+    int settled = 0;
+    Clock::time_point mark; // Start of the current rate interval.
+    uint64_t written = 0;   // Bytes written since `mark`.
+    double rate = 0;        // Bytes per second written over the last interval; 0 if not known.
+
+    bool known(int level) const { return costs[level] > 0 && recorded - measured[level] < COST_LIFETIME; }
+
+    double capacity(int level) const { return workers / costs[level]; }
+
+    void step(int delta) {
+        current += delta;
+        settled = 0;
+        // The rate so far was measured at the old level.
+        rate = 0;
+        restartRate();
+    }
+
+    void restartRate() {
+        mark = Clock::now();
+        written = 0;
+    }
+};
+
+// Push side of the compression pipeline: the caller fills buffers from
+// nextBuffer() and hands them to submit(); chunks are compressed on the node
+// workers and written in order through `write` as the window fills up. Each
+// pipeline is a separate job on the shared workers, scheduled fairly against
+// other pipelines.
+class ChunkPipeline {
+public:
+    // `flags` are the job's header flags. If given, `chunk_offsets` receives
+    // the container offset of each chunk as it is written, and chunks found in
+    // `base` are copied from it rather than compressed.
+    ChunkPipeline(Compressor::Impl& engine, Lane& lane, Sink write, RunStats& stats, ProgressReporter* progress,
+                  uint16_t flags, std::vector<uint64_t>* chunk_offsets = nullptr, const BaseContainer* base = nullptr)
+        : engine(engine), lane(lane), write(std::move(write)), stats(stats), progress(progress),
+          chunk_offsets(chunk_offsets), base(base), indexed(flags & FLAG_CHUNK_INDEX),
+          dedup(engine.options.dedup ? std::make_unique<DedupTable>() : nullptr),
+          levels(engine.options.target_mbps > 0
+                     ? std::make_unique<LevelController>(engine.options.target_mbps * 1024 * 1024, engine.total_threads)
+                     : nullptr),
+          window(engine.per_node_window * engine.nodes.size()), slots(window),
+          compress_phase(stats.phase("compress")), reorder_phase(stats.phase("reorder")),
+          write_phase(stats.phase("write")) {
+        for (NodeContext& node : engine.nodes)
+            tasks.push_back(std::make_unique<TaskGroup>(*node.workers));
+        if (levels) {
+            stats.level_chunks.assign(Z_BEST_COMPRESSION + 1, 0);
+        }
+    }
+
+    // Returns an empty input buffer for the next chunk, writing out the oldest
+    // chunk first if the window is full. Blocks while every input buffer is in flight.
+    PooledBuffer nextBuffer() {
+        // Keep the window bounded: the writer must catch up before we read more.
+        if (next_id - next_write == window) {
+            writeNext();
+        }
+        TraceScope trace("acquire input", "reader", next_id);
+        return lane.input_pools[currentNode()]->acquire();
+    }
+
+    // Queues a buffer from nextBuffer() as the next chunk.
+    void submit(PooledBuffer buffer) {
+        size_t node = currentNode();
+        size_t id = next_id++;
+        uint64_t position = next_position;
+        next_position += buffer.size();
+        int level = levels ? levels->level() : engine.options.level;
+        BufferPool* output_pool = lane.output_pools[node].get();
+        slots[id % window] = tasks[node]->submit(
+            [this, id, position, level, input = std::move(buffer), output_pool]() mutable {
+                return compressChunk(id, position, level, input, *output_pool);
+            });
+    }
+
+    // Writes every chunk submitted so far, in order.
+    void drain() {
+        while (next_write < next_id) {
+            writeNext();
+        }
+    }
+
+    // Drains and ends the chunks, appending the chunk index if there is one.
+    void finish() {
+        drain();
+        if (!indexed) {
+            return;
+        }
+        ScopedPhase timer(write_phase);
+        Buffer table;
+        appendValue<uint32_t>(table, 0);
+        uint64_t index_offset = FILE_HEADER_SIZE + write_phase.bytes + table.size();
+        for (const IndexEntry& entry : index) {
+            appendValue<uint64_t>(table, entry.data_offset);
+            appendValue<uint32_t>(table, entry.compressed_size);
+            appendValue<uint32_t>(table, entry.raw_size);
+            appendValue<uint64_t>(table, entry.digest.low);
+            appendValue<uint64_t>(table, entry.digest.high);
+        }
+        appendValue<uint64_t>(table, index_offset);
+        appendValue<uint32_t>(table, index.size());
+        table.insert(table.end(), INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC));
+        write(table.data(), table.size());
+        write_phase.bytes += table.size();
+    }
+
+    size_t chunks() const { return next_id; }
+
+private:
+    Compressor::Impl& engine;
+    Lane& lane;
+    Sink write;
+    RunStats& stats;
+    ProgressReporter* progress;
+    std::vector<uint64_t>* chunk_offsets;
+    const BaseContainer* base;
+    bool indexed;
+    std::vector<IndexEntry> index;        // One per chunk written, when indexed.
+    std::unique_ptr<DedupTable> dedup;
+    std::unique_ptr<LevelController> levels; // With a throughput target.
+    std::vector<uint64_t> record_offsets; // With dedup, where each chunk's record was written.
+    size_t window;
+    std::vector<std::future<ChunkResult>> slots; // In-flight chunk `id` lives at `id % window`.
+    PhaseStats& compress_phase;
+    PhaseStats& reorder_phase;
+    PhaseStats& write_phase;
+    size_t next_id = 0;    // Next chunk id to assign.
+    size_t next_write = 0; // Next chunk id the writer expects.
+    uint64_t next_position = 0; // Uncompressed offset of the next chunk, for delta compression.
+    // One job per node. Declared last so in-flight tasks, which refer to this
+    // pipeline, finish before anything else is destroyed, even when unwinding
+    // from an error.
+    std::vector<std::unique_ptr<TaskGroup>> tasks;
+
+    // Chunks are assigned to nodes round-robin by id. Each node owns an equal share
+    // of the window, so slot `id % window` always belongs to node `id % nodes`.
+    size_t currentNode() const { return next_id % engine.nodes.size(); }
+
+    // Runs on a worker thread. `position` is where the chunk starts in the input.
+    ChunkResult compressChunk(size_t id, uint64_t position, int level, PooledBuffer& input, BufferPool& output_pool) {
+        AllocPhaseScope alloc_scope(compress_phase.index);
+        TraceScope trace("compress", "worker", id);
+        bool rsyncable = engine.options.rsyncable;
+        const DeltaReference* reference = engine.reference.get();
+        const Buffer* dictionary = &engine.dictionary;
+        ChunkResult result;
+        if (dedup || indexed || base) {
+            auto start = Clock::now();
+            result.digest = digestChunk(input.data(), input.size());
+            if (dedup) {
+                result.original = dedup->claim(result.digest, id);
+                result.duplicate = result.original != id;
+            }
+            if (base && !result.duplicate) {
+                auto found = base->chunks.find(result.digest);
+                if (found != base->chunks.end() && found->second.raw_size == input.size()) {
+                    result.reused = &found->second;
+                }
+            }
+            if (result.duplicate || result.reused) {
+                // Nothing to compress: the writer refers to or copies the bytes.
+                result.raw_size = input.size();
+                result.seconds = secondsSince(start);
+                if (progress) {
+                    progress->add(input.size());
+                }
+                input.reset();
+                return result;
+            }
+        }
+        try {
+            ChunkDigest digest = result.digest;
+            result = runCodec(
+                [level, rsyncable, reference, dictionary, position](const PooledBuffer& in, PooledBuffer& out) {
+                    if (reference) {
+                        out.resize(compressDelta(*reference, position, in.data(), in.size(), out.data(), out.capacity(),
+                                                 level));
+                    } else {
+                        compressData(in, out, level, rsyncable, dictionary->data(), dictionary->size());
+                    }
+                },
+                input, output_pool, engine.options.perf_counters);
+            result.digest = digest;
+            result.level = level;
+        } catch (const std::exception& e) {
+            throw std::runtime_error("Compression failed for chunk " + std::to_string(id) + ": " + e.what());
+        }
+        result.raw_size = input.size();
+        if (progress) {
+            progress->add(input.size());
+        }
+        // The input buffer can be reused as soon as the chunk is compressed.
+        input.reset();
+        return result;
+    }
+
+    // Waits for the oldest in-flight chunk and writes it.
+    void writeNext() {
+        size_t id = next_write++;
+        ChunkResult result;
+        bool waited;
+        {
+            // Time spent here is the writer waiting for chunks to arrive in order.
+            ScopedPhase timer(reorder_phase);
+            TraceScope trace("reorder wait", "writer", id);
+            std::future<ChunkResult>& slot = slots[id % window];
+            waited = slot.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+            // Rethrows the worker's exception if the chunk failed.
+            result = slot.get();
+        }
+        addChunkStats(stats, compress_phase, result);
+        if (levels && !result.duplicate && !result.reused) {
+            levels->record(result.level, result.raw_size, result.seconds, waited);
+            ++stats.level_chunks[result.level];
+        }
+        {
+            // We also need to write the size of the chunk so we can decompress it later.
+            ScopedPhase timer(write_phase);
+            TraceScope trace("write", "io", id);
+            uint64_t offset = FILE_HEADER_SIZE + write_phase.bytes;
+            if (chunk_offsets) {
+                chunk_offsets->push_back(offset);
+            }
+            if (dedup) {
+                record_offsets.push_back(offset);
+            }
+            if (result.duplicate) {
+                // Point at the original's record; it was written before this one.
+                uint32_t marker = DUPLICATE_CHUNK;
+                uint64_t original_offset = record_offsets[result.original];
+                write(reinterpret_cast<const unsigned char*>(&marker), sizeof(marker));
+                write(reinterpret_cast<const unsigned char*>(&original_offset), sizeof(original_offset));
+                write_phase.bytes += sizeof(marker) + sizeof(original_offset);
+                ++stats.duplicate_chunks;
+                if (indexed) {
+                    IndexEntry entry = index[result.original];
+                    index.push_back(entry);
+                }
+                return;
+            }
+            uint32_t size = result.reused ? result.reused->compressed_size : result.data.size();
+            write(reinterpret_cast<const unsigned char*>(&size), sizeof(size));
+            write_phase.bytes += sizeof(size);
+            if (engine.options.content_defined) {
+                // Variable-size chunks also record how big they are uncompressed.
+                write(reinterpret_cast<const unsigned char*>(&result.raw_size), sizeof(result.raw_size));
+                write_phase.bytes += sizeof(result.raw_size);
+            }
+            uint64_t data_offset = FILE_HEADER_SIZE + write_phase.bytes;
+            if (result.reused) {
+                base->copy(*result.reused);
+                ++stats.reused_chunks;
+            } else {
+                write(result.data.data(), size);
+            }
+            write_phase.bytes += size;
+            if (indexed) {
+                index.push_back({data_offset, size, result.raw_size, result.digest});
+            }
+        }
+    }
+};
+
+} // namespace
+
+PhaseStats& Compressor::Impl::beginJob(const Sink& write, RunStats& stats, uint16_t flags) const {
+    stats = RunStats();
+    stats.tool = "compressor";
+    PhaseStats& read_phase = stats.phase("read");
+
+    FileHeader header;
+    header.flags = jobFlags(flags);
+    header.chunk_size = max_chunk_size;
+    header.dictionary_id = dictionary_id;
+    unsigned char header_bytes[FILE_HEADER_SIZE];
+    encodeFileHeader(header, header_bytes);
+    write(header_bytes, sizeof(header_bytes));
+    return read_phase;
+}
+
+uint16_t Compressor::Impl::jobFlags(uint16_t flags) const {
+    return flags | (options.content_defined ? FLAG_CONTENT_DEFINED : 0) | (options.dedup ? FLAG_DEDUP : 0) |
+           (options.chunk_index ? FLAG_CHUNK_INDEX : 0) | (reference ? FLAG_DELTA : 0) |
+           (dictionary.empty() ? 0 : FLAG_DICTIONARY);
+}
+
+void Compressor::Impl::endJob(RunStats& stats, size_t chunks, Clock::time_point start) const {
+    PhaseStats& compress_phase = stats.phase("compress");
+    stats.wall_seconds = secondsSince(start);
+    stats.threads = total_threads;
+    stats.chunks = chunks;
+    stats.bytes_in = stats.phase("read").bytes;
+    stats.bytes_out = FILE_HEADER_SIZE + stats.phase("write").bytes;
+    stats.worker_busy_seconds = compress_phase.seconds;
+    stats.perf_enabled = options.perf_counters;
+    stats.counted_bytes = stats.bytes_in;
+    compress_phase.bytes = stats.bytes_in;
+}
+
+ReadFn Compressor::Impl::chunkReader(ReadFn source) const {
+    return options.content_defined ? contentDefinedReader(std::move(source), chunker) : source;
+}
+
+void Compressor::Impl::run(const ReadFn& read, const Sink& write, RunStats& stats, ProgressReporter* progress,
+                           uint16_t flags, std::vector<uint64_t>* chunk_offsets, const BaseContainer* base) {
+    LaneLease lease(*this);
+    auto run_start = Clock::now();
+    PhaseStats& read_phase = beginJob(write, stats, flags);
+    ChunkPipeline pipeline(*this, lease.lane(), write, stats, progress, jobFlags(flags), chunk_offsets, base);
+
+    while (true) {
+        PooledBuffer buffer = pipeline.nextBuffer();
+        size_t bytes_read;
+        {
+            ScopedPhase timer(read_phase);
+            TraceScope trace("read", "io", pipeline.chunks());
+            bytes_read = read(buffer.data(), max_chunk_size);
+            read_phase.bytes += bytes_read;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        buffer.resize(bytes_read);
+        pipeline.submit(std::move(buffer));
+    }
+    pipeline.finish();
+    endJob(stats, pipeline.chunks(), run_start);
+}
+
+// A streaming job: holds a lane until finished and accumulates caller data
+// into `pending` until a whole chunk is ready.
+struct StreamingCompressor::State {
+    Compressor::Impl& engine;
+    LaneLease lease;
+    RunStats local_stats;
+    RunStats& stats;
+    Clock::time_point start;
+    PhaseStats& read_phase;
+    ChunkPipeline pipeline;
+    PooledBuffer pending; // Declared after the pipeline so it goes back to its pool first.
+    bool finished = false;
+
+    State(Compressor::Impl& engine, const Sink& sink, RunStats* stats_out)
+        : engine(engine), lease(engine), stats(stats_out ? *stats_out : local_stats), start(Clock::now()),
+          read_phase(engine.beginJob(sink, stats)),
+          pipeline(engine, lease.lane(), sink, stats, nullptr, engine.jobFlags(0)) {}
+};
+
+StreamingCompressor::StreamingCompressor(Compressor& compressor, Sink sink, RunStats* stats)
+    : state(std::make_unique<State>(*compressor.impl, sink, stats)) {}
+
+StreamingCompressor::~StreamingCompressor() = default;
+
+void StreamingCompressor::write(const unsigned char* data, size_t size) {
+    State& s = *state;
+    if (s.finished) {
+        throw std::runtime_error("StreamingCompressor::write called after finish");
+    }
+    size_t chunk_size = s.engine.options.chunk_size;
+    while (size > 0) {
+        if (!s.pending.data()) {
+            // Blocks, writing out older chunks, while the window is full.
+            s.pending = s.pipeline.nextBuffer();
+        }
+        size_t n = std::min(size, chunk_size - s.pending.size());
+        {
+            ScopedPhase timer(s.read_phase);
+            std::memcpy(s.pending.data() + s.pending.size(), data, n);
+            s.pending.resize(s.pending.size() + n);
+            s.read_phase.bytes += n;
+        }
+        data += n;
+        size -= n;
+        if (s.pending.size() == chunk_size) {
+            s.pipeline.submit(std::move(s.pending));
+        }
+    }
+}
+
+void StreamingCompressor::flush() {
+    State& s = *state;
+    if (s.finished) {
+        return;
+    }
+    if (!s.pending.empty()) {
+        s.pipeline.submit(std::move(s.pending));
+    }
+    s.pipeline.drain();
+}
+
+void StreamingCompressor::finish() {
+    State& s = *state;
+    if (s.finished) {
+        return;
+    }
+    flush();
+    s.pipeline.finish();
+    s.pending.reset();
+    s.finished = true;
+    s.engine.endJob(s.stats, s.pipeline.chunks(), s.start);
+    // Nothing is in flight any more, so the buffers are free for other jobs.
+    s.lease.release();
+}
+
+Compressor::Compressor(const Options& options) : impl(std::make_unique<Impl>(options)) {}
+
+Compressor::~Compressor() = default;
+
+void Compressor::compress(std::istream& in, std::ostream& out, RunStats* stats, ProgressReporter* progress) {
+    RunStats local;
+    impl->run(impl->chunkReader(streamReader(in)), streamWriter(out), stats ? *stats : local, progress);
+    flushStream(out);
+}
+
+Buffer Compressor::compress(const unsigned char* data, size_t size, RunStats* stats) {
+    Buffer result;
+    result.reserve(FILE_HEADER_SIZE + compressBound(size));
+    RunStats local;
+    impl->run(impl->chunkReader(memoryReader(data, size)), memoryWriter(result), stats ? *stats : local, nullptr);
+    return result;
+}
+
+std::vector<Buffer> Compressor::compressBatch(const std::vector<Buffer>& inputs) {
+    const Options& options = impl->options;
+    std::vector<Buffer> results(inputs.size());
+    FileHeader header;
+    header.chunk_size = options.chunk_size;
+    const Buffer* dictionary = &impl->dictionary;
+    if (!dictionary->empty()) {
+        header.flags = FLAG_DICTIONARY;
+        header.dictionary_id = impl->dictionary_id;
+    }
+    unsigned char header_bytes[FILE_HEADER_SIZE];
+    encodeFileHeader(header, header_bytes);
+
+    // Each input that fits in one chunk becomes a single task that writes its
+    // whole container. The tasks are spread over the nodes round-robin and
+    // queued per node in one go.
+    std::vector<std::vector<std::function<void()>>> batches(impl->nodes.size());
+    std::vector<size_t> large;
+    size_t next_node = 0;
+    int level = options.level;
+    bool rsyncable = options.rsyncable;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        // Delta chunks need the pipeline too, which tracks where each one starts.
+        if (inputs[i].size() > options.chunk_size || impl->reference) {
+            large.push_back(i);
+            continue;
+        }
+        const Buffer* input = &inputs[i];
+        Buffer* output = &results[i];
+        batches[next_node++ % batches.size()].push_back([input, output, &header_bytes, level, rsyncable, dictionary] {
+            size_t bound = compressedBound(input->size(), rsyncable);
+            output->resize(FILE_HEADER_SIZE + sizeof(uint32_t) + bound);
+            std::memcpy(output->data(), header_bytes, FILE_HEADER_SIZE);
+            if (input->empty()) {
+                // An empty input has no chunks, exactly as compress() writes it.
+                output->resize(FILE_HEADER_SIZE);
+                return;
+            }
+            unsigned char* body = output->data() + FILE_HEADER_SIZE + sizeof(uint32_t);
+            uint32_t size = compressBytes(input->data(), input->size(), body, bound, level, rsyncable, dictionary->data(),
+                                          dictionary->size());
+            std::memcpy(output->data() + FILE_HEADER_SIZE, &size, sizeof(size));
+            output->resize(FILE_HEADER_SIZE + sizeof(size) + size);
+        });
+    }
+
+    // Declared before the futures so every task has finished before anything
+    // it touches is destroyed, even when unwinding from an error.
+    std::vector<std::unique_ptr<TaskGroup>> groups;
+    std::vector<std::future<void>> done;
+    for (size_t n = 0; n < batches.size(); ++n) {
+        if (batches[n].empty()) {
+            continue;
+        }
+        groups.push_back(std::make_unique<TaskGroup>(*impl->nodes[n].workers));
+        for (auto& future : groups.back()->submitBatch(std::move(batches[n])))
+            done.push_back(std::move(future));
+    }
+    // Large inputs go through the pipeline while the batch runs.
+    for (size_t i : large)
+        results[i] = compress(inputs[i]);
+    for (auto& future : done)
+        future.get();
+    return results;
+}
+
+const Options& Compressor::options() const { return impl->options; }
+
+size_t Compressor::threads() const { return impl->total_threads; }
+
+size_t Compressor::numaNodes() const { return impl->nodes.size(); }
+
+PageBacking Compressor::pageBacking() const {
+    std::lock_guard<std::mutex> lock(impl->lanes_mutex);
+    return impl->lanes[0]->input_pools[0]->backing();
+}
+
+namespace {
+
+// The largest compressed record a chunk of up to `chunk_size` bytes can have:
+// rsyncable output, which nothing in the file marks, or a delta chunk.
+size_t maxCompressedChunk(size_t chunk_size) {
+    return std::max(compressedBound(chunk_size, true), deltaBound(chunk_size));
+}
+
+} // namespace
+
+// Chunk buffers for one decompression job. The chunk size comes from each
+// file's header, so a lane only serves files with the chunk size it was built for.
+struct DecodeLane {
+    size_t chunk_size;
+    BufferPool input_pool;
+    BufferPool output_pool;
+
+    DecodeLane(size_t chunk_size, size_t count)
+        : chunk_size(chunk_size), input_pool(maxCompressedChunk(chunk_size), count), output_pool(chunk_size, count) {}
+};
+
+struct Decompressor::Impl {
+    Options options;
+    size_t threads = 0;
+    size_t window = 0;
+    std::unique_ptr<ThreadPool> own_workers; // Unset when borrowing a Compressor's workers.
+    std::vector<ThreadPool*> workers;        // One pool per node; chunks go round-robin.
+    std::mutex lanes_mutex;
+    std::vector<std::unique_ptr<DecodeLane>> idle_lanes; // Kept for reuse by later calls.
+    std::unique_ptr<DeltaReference> own_reference;       // Unset when borrowing a Compressor's.
+    const DeltaReference* reference = nullptr;           // For files compressed with FLAG_DELTA.
+    Buffer own_dictionary;
+    const Buffer* dictionary = &own_dictionary;          // For files compressed with FLAG_DICTIONARY.
+
+    explicit Impl(const Options& opts) : options(opts) {
+        options.cpus = usableCpus(options.cpus);
+        std::vector<int> allowed = options.cpus.empty() ? allowedCpus() : options.cpus;
+        threads = options.threads ? options.threads : defaultThreadCount(allowed);
+        window = threads * 2;
+        own_workers = std::make_unique<ThreadPool>(threads, options.cpus);
+        workers.push_back(own_workers.get());
+        if (!options.reference.empty()) {
+            own_reference = std::make_unique<DeltaReference>(options.reference, false);
+            reference = own_reference.get();
+        }
+        if (!options.dictionary.empty()) {
+            own_dictionary = readDictionary(options.dictionary);
+        }
+    }
+
+    explicit Impl(Compressor::Impl& shared)
+        : options(shared.options), reference(shared.reference.get()), dictionary(&shared.dictionary) {
+        for (NodeContext& node : shared.nodes) {
+            threads += node.workers->size();
+            workers.push_back(node.workers.get());
+        }
+        window = threads * 2;
+    }
+
+    std::unique_ptr<DecodeLane> acquireLane(size_t chunk_size) {
+        {
+            std::lock_guard<std::mutex> lock(lanes_mutex);
+            for (auto it = idle_lanes.begin(); it != idle_lanes.end(); ++it) {
+                if ((*it)->chunk_size == chunk_size) {
+                    std::unique_ptr<DecodeLane> lane = std::move(*it);
+                    idle_lanes.erase(it);
+                    return lane;
+                }
+            }
+        }
+        return std::make_unique<DecodeLane>(chunk_size, window);
+    }
+
+    void releaseLane(std::unique_ptr<DecodeLane> lane) {
+        std::lock_guard<std::mutex> lock(lanes_mutex);
+        if (idle_lanes.size() >= options.max_jobs) {
+            // Drop the oldest so a stream of odd chunk sizes cannot pin memory.
+            idle_lanes.erase(idle_lanes.begin());
+        }
+        idle_lanes.push_back(std::move(lane));
+    }
+
+    // `fetch` resolves dedup references; without it they are an error.
+    void run(const ReadFn& read, const Sink& write, RunStats& stats, ProgressReporter* progress,
+             const FetchFn& fetch = nullptr);
+};
+
+// Chunks are read and written in order on the calling thread and inflated on
+// the workers, with at most `window` of them in flight.
+void Decompressor::Impl::run(const ReadFn& read, const Sink& write, RunStats& stats, ProgressReporter* progress,
+                             const FetchFn& fetch) {
+    auto run_start = Clock::now();
+    stats = RunStats();
+    stats.tool = "decompressor";
+    stats.threads = threads;
+    stats.perf_enabled = options.perf_counters;
+    PhaseStats& read_phase = stats.phase("read");
+    PhaseStats& decompress_phase = stats.phase("decompress");
+    PhaseStats& reorder_phase = stats.phase("reorder");
+    PhaseStats& write_phase = stats.phase("write");
+
+    // The header tells us the largest chunk to expect; legacy files use the default.
+    // Legacy files start straight with a chunk, so their first four bytes are
+    // already that chunk's size prefix.
+    FileHeader header;
+    unsigned char header_bytes[FILE_HEADER_SIZE];
+    size_t prefix_bytes = read(header_bytes, sizeof(uint32_t));
+    if (prefix_bytes == 0) {
+        stats.wall_seconds = secondsSince(run_start);
+        return;
+    }
+    if (prefix_bytes != sizeof(uint32_t)) {
+        throw std::runtime_error("Failed to read chunk size. File may be corrupt.");
+    }
+    bool legacy = !isFileHeaderMagic(header_bytes);
+    bool archive = false;
+    bool indexed = false;   // A chunk index follows the chunks.
+    bool raw_sizes = false; // Each size prefix is followed by the uncompressed size.
+    bool dedup = false;     // Records may refer back to an earlier chunk.
+    uint64_t header_size = legacy ? 0 : FILE_HEADER_SIZE;
+    if (!legacy) {
+        size_t rest = FILE_HEADER_SIZE - sizeof(uint32_t);
+        if (read(header_bytes + sizeof(uint32_t), rest) != rest || !decodeFileHeader(header_bytes, header)) {
+            throw std::runtime_error("Unsupported or corrupt file header.");
+        }
+        if (header.flags & ~KNOWN_FLAGS) {
+            throw std::runtime_error("Unsupported container flags.");
+        }
+        archive = header.flags & FLAG_ARCHIVE;
+        indexed = header.flags & FLAG_CHUNK_INDEX;
+        raw_sizes = header.flags & FLAG_CONTENT_DEFINED;
+        dedup = header.flags & FLAG_DEDUP;
+    }
+    const DeltaReference* delta = nullptr; // The reference, if chunks were compressed against one.
+    if (header.flags & FLAG_DELTA) {
+        if (!reference) {
+            throw std::runtime_error("This file was compressed against a reference file; give the same file to decompress it.");
+        }
+        if (reference->id() != header.dictionary_id) {
+            throw std::runtime_error("The reference file does not match the one this file was compressed against.");
+        }
+        delta = reference;
+    }
+    const Buffer* preset = nullptr; // The dictionary, if chunks were compressed with one.
+    if (header.flags & FLAG_DICTIONARY) {
+        if (dictionary->empty()) {
+            throw std::runtime_error("This file was compressed with a dictionary; give the same one to decompress it.");
+        }
+        if (dictionaryId(dictionary->data(), dictionary->size()) != header.dictionary_id) {
+            throw std::runtime_error("The dictionary does not match the one this file was compressed with.");
+        }
+        preset = dictionary;
+    }
+
+    // Buffers come from a recycled lane, so steady state does no heap allocation.
+    // Declared before the tasks so in-flight work finishes before the buffers go.
+    std::unique_ptr<DecodeLane> lane = acquireLane(header.chunk_size);
+    std::vector<std::future<ChunkResult>> slots(window);
+    size_t next_id = 0;
+    size_t duplicates = 0;
+    size_t next_write = 0;
+    // One job per worker pool, each scheduled fairly against other jobs there.
+    std::vector<std::unique_ptr<TaskGroup>> tasks;
+    for (ThreadPool* pool : workers)
+        tasks.push_back(std::make_unique<TaskGroup>(*pool));
+
+    // Waits for the oldest in-flight chunk and writes it.
+    auto writeNext = [&]() {
+        size_t id = next_write++;
+        ChunkResult result;
+        {
+            ScopedPhase timer(reorder_phase);
+            result = slots[id % window].get();
+        }
+        addChunkStats(stats, decompress_phase, result);
+        decompress_phase.bytes += result.data.size();
+        ScopedPhase timer(write_phase);
+        write(result.data.data(), result.data.size());
+        write_phase.bytes += result.data.size();
+    };
+
+    // The record a duplicate points at, read through `fetch`. Repeats of one
+    // chunk tend to come in runs (zero-filled regions), so the last one is kept.
+    uint64_t cached_offset = UINT64_MAX;
+    uint32_t cached_raw_size = 0;
+    Buffer cached_data;
+    auto fetchRecord = [&](uint64_t offset) {
+        if (!fetch) {
+            throw std::runtime_error("Deduplicated chunks can only be read from seekable input.");
+        }
+        uint32_t size;
+        fetch(offset, reinterpret_cast<unsigned char*>(&size), sizeof(size));
+        offset += sizeof(size);
+        if (size == 0 || size == DUPLICATE_CHUNK || size > maxCompressedChunk(header.chunk_size)) {
+            throw std::runtime_error("Duplicate chunk refers to an invalid record. File may be corrupt.");
+        }
+        if (raw_sizes) {
+            fetch(offset, reinterpret_cast<unsigned char*>(&cached_raw_size), sizeof(cached_raw_size));
+            offset += sizeof(cached_raw_size);
+        }
+        cached_data.resize(size);
+        fetch(offset, cached_data.data(), size);
+    };
+
+    while (true) {
+        if (next_id - next_write == window) {
+            writeNext();
+        }
+
+        // --- Step 1: Read the size of the next compressed chunk ---
+        ScopedPhase timer(read_phase);
+        uint32_t compressedChunkSize;
+        if (legacy) {
+            std::memcpy(&compressedChunkSize, header_bytes, sizeof(compressedChunkSize));
+            legacy = false;
+        } else {
+            size_t n = read(reinterpret_cast<unsigned char*>(&compressedChunkSize), sizeof(compressedChunkSize));
+            if (n == 0) {
+                // The input ended cleanly on a chunk boundary.
+                break;
+            }
+            if (n != sizeof(compressedChunkSize)) {
+                throw std::runtime_error("Failed to read chunk size. File may be corrupt.");
+            }
+            if ((archive || indexed) && compressedChunkSize == 0) {
+                // The file table or chunk index follows; neither is needed here.
+                read_phase.bytes += n;
+                break;
+            }
+        }
+
+        uint32_t raw_size = 0;
+        size_t record_size = sizeof(compressedChunkSize);
+        bool duplicate = dedup && compressedChunkSize == DUPLICATE_CHUNK;
+        if (duplicate) {
+            uint64_t offset;
+            if (read(reinterpret_cast<unsigned char*>(&offset), sizeof(offset)) != sizeof(offset)) {
+                throw std::runtime_error("Failed to read chunk size. File may be corrupt.");
+            }
+            record_size += sizeof(offset);
+            if (offset != cached_offset) {
+                cached_offset = UINT64_MAX;
+                fetchRecord(offset);
+                cached_offset = offset;
+            }
+            compressedChunkSize = cached_data.size();
+            raw_size = cached_raw_size;
+            ++duplicates;
+        } else if (raw_sizes) {
+            if (read(reinterpret_cast<unsigned char*>(&raw_size), sizeof(raw_size)) != sizeof(raw_size) ||
+                raw_size > header.chunk_size) {
+                throw std::runtime_error("Failed to read chunk size. File may be corrupt.");
+            }
+            record_size += sizeof(raw_size);
+        }
+
+        // --- Step 2: Read the compressed chunk data ---
+        PooledBuffer compressedData = lane->input_pool.acquire();
+        if (compressedChunkSize > compressedData.capacity()) {
+            throw std::runtime_error("Chunk size " + std::to_string(compressedChunkSize) +
+                                     " exceeds the maximum. File may be corrupt.");
+        }
+        compressedData.resize(compressedChunkSize);
+        if (duplicate) {
+            std::memcpy(compressedData.data(), cached_data.data(), compressedChunkSize);
+            compressedChunkSize = 0; // Only the reference itself was read from the input.
+        } else if (read(compressedData.data(), compressedChunkSize) != compressedChunkSize) {
+            throw std::runtime_error("Failed to read chunk data. File may be corrupt or truncated.");
+        }
+        read_phase.bytes += record_size + compressedChunkSize;
+        if (progress) {
+            progress->add(record_size + compressedChunkSize);
+        }
+
+        // --- Step 3: Decompress the chunk on a worker ---
+        size_t id = next_id++;
+        BufferPool* output_pool = &lane->output_pool;
+        int alloc_phase = decompress_phase.index;
+        bool count_perf = options.perf_counters;
+        slots[id % window] = tasks[id % tasks.size()]->submit([id, input = std::move(compressedData), output_pool, alloc_phase, count_perf,
+                                                               raw_sizes, raw_size, delta, preset] {
+            AllocPhaseScope alloc_scope(alloc_phase);
+            TraceScope trace("decompress", "worker", id);
+            ChunkResult result;
+            try {
+                result = runCodec(
+                    [delta, preset](const PooledBuffer& in, PooledBuffer& out) {
+                        if (delta) {
+                            out.resize(decompressDelta(*delta, in.data(), in.size(), out.data(), out.capacity()));
+                        } else if (preset) {
+                            decompressData(in, out, preset->data(), preset->size());
+                        } else {
+                            decompressData(in, out);
+                        }
+                    },
+                    input, *output_pool, count_perf);
+            } catch (const std::exception& e) {
+                throw std::runtime_error("Decompression failed for chunk " + std::to_string(id) + ": " + e.what());
+            }
+            if (raw_sizes && result.data.size() != raw_size) {
+                throw std::runtime_error("Chunk " + std::to_string(id) + " decompressed to " + std::to_string(result.data.size()) +
+                                         " bytes instead of " + std::to_string(raw_size) + ". File may be corrupt.");
+            }
+            return result;
+        });
+    }
+
+    // --- Step 4: Write the remaining chunks in order ---
+    while (next_write < next_id) {
+        writeNext();
+    }
+    for (auto& group : tasks)
+        group->wait();
+    slots.clear();
+    releaseLane(std::move(lane));
+
+    stats.wall_seconds = secondsSince(run_start);
+    stats.chunks = next_id;
+    stats.duplicate_chunks = duplicates;
+    stats.bytes_in = header_size + read_phase.bytes;
+    stats.bytes_out = write_phase.bytes;
+    stats.worker_busy_seconds = decompress_phase.seconds;
+    stats.counted_bytes = stats.bytes_out;
+}
+
+Decompressor::Decompressor(const Options& options) : impl(std::make_unique<Impl>(options)) {}
+
+Decompressor::~Decompressor() = default;
+
+Decompressor::Decompressor(Compressor& shared) : impl(std::make_unique<Impl>(*shared.impl)) {}
+
+size_t Decompressor::threads() const { return impl->threads; }
+
+void Decompressor::decompress(std::istream& in, std::ostream& out, RunStats* stats, ProgressReporter* progress) {
+    RunStats local;
+    FetchFn fetch = streamFetcher(in, in.tellg());
+    impl->run(streamReader(in), streamWriter(out), stats ? *stats : local, progress, fetch);
+    flushStream(out);
+}
+
+Buffer Decompressor::decompress(const unsigned char* data, size_t size, RunStats* stats) {
+    Buffer result;
+    RunStats local;
+    impl->run(memoryReader(data, size), memoryWriter(result), stats ? *stats : local, nullptr,
+              memoryFetcher(data, size));
+    return result;
+}
+
+namespace {
+
+namespace fs = std::filesystem;
+
+const int64_t NANOSECONDS_PER_SECOND = 1000000000;
+
+// An entry to archive and where its data lives on disk.
+struct ArchiveSource {
+    ArchiveEntry entry;
+    std::string disk_path;
+};
+
+// Fills in everything but the path. Returns false for symbolic links and
+// special files, unless `follow` and the link leads to a file or directory.
+bool statEntry(const fs::path& path, bool follow, ArchiveEntry& entry) {
+    struct stat st;
+    if ((follow ? ::stat(path.c_str(), &st) : ::lstat(path.c_str(), &st)) != 0) {
+        throw std::runtime_error("Could not stat " + path.string() + ": " + std::strerror(errno));
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+    entry.directory = S_ISDIR(st.st_mode);
+    entry.mode = st.st_mode & 07777;
+    entry.mtime_ns = int64_t(st.st_mtim.tv_sec) * NANOSECONDS_PER_SECOND + st.st_mtim.tv_nsec;
+    entry.size = entry.directory ? 0 : st.st_size;
+    return true;
+}
+
+// Expands the paths given to compressFiles(), sorted by archive path so files
+// from one directory sit next to each other. Named paths are followed if they
+// are links; links found while walking are skipped.
+std::vector<ArchiveSource> collectSources(const std::vector<std::string>& paths) {
+    std::vector<ArchiveSource> sources;
+    try {
+        for (const std::string& arg : paths) {
+            fs::path root = fs::absolute(arg).lexically_normal();
+            if (!root.has_filename()) {
+                root = root.parent_path(); // "dir/" normalizes with an empty filename.
+            }
+            if (root == root.root_path()) {
+                throw std::runtime_error("Cannot archive the root directory");
+            }
+            fs::path name = root.filename();
+
+            ArchiveSource top;
+            if (!statEntry(root, true, top.entry)) {
+                continue;
+            }
+            top.entry.path = name.generic_string();
+            top.disk_path = root.string();
+            bool walk = top.entry.directory;
+            sources.push_back(std::move(top));
+            if (!walk) {
+                continue;
+            }
+            for (const fs::directory_entry& item : fs::recursive_directory_iterator(root)) {
+                ArchiveSource source;
+                if (statEntry(item.path(), false, source.entry)) {
+                    source.entry.path = (name / item.path().lexically_relative(root)).generic_string();
+                    source.disk_path = item.path().string();
+                    sources.push_back(std::move(source));
+                }
+            }
+        }
+    } catch (const fs::filesystem_error& e) {
+        throw std::runtime_error(e.what());
+    }
+    std::sort(sources.begin(), sources.end(),
+              [](const ArchiveSource& a, const ArchiveSource& b) { return a.entry.path < b.entry.path; });
+    sources.erase(std::unique(sources.begin(), sources.end(),
+                              [](const ArchiveSource& a, const ArchiveSource& b) { return a.entry.path == b.entry.path; }),
+                  sources.end());
+    return sources;
+}
+
+// Where a chunk of an archive lives and how much data it holds.
+struct ArchiveChunk {
+    uint64_t offset = 0; // Container offset of the chunk's size prefix.
+    uint32_t size = 0;   // Uncompressed bytes.
+};
+
+// Reads the archived files back to back as one stream, packing them into
+// solid chunks: a file that fits in a chunk never straddles two, so the chunk
+// is closed early if the next such file does not fit in what is left. Larger
+// files fill up the current chunk and carry on through the following ones.
+// Each file's chunk and offset are recorded in its entry as it starts, and
+// each chunk's size in `chunks`. Exactly the size recorded when the file was
+// listed is read; a file that shrank since then is an error.
+ReadFn archiveReader(std::vector<ArchiveSource>& sources, std::vector<ArchiveChunk>& chunks) {
+    struct State {
+        size_t next = 0;
+        const ArchiveSource* current = nullptr;
+        std::ifstream file;
+        uint64_t remaining = 0;
+    };
+    auto state = std::make_shared<State>();
+    return [&sources, &chunks, state](unsigned char* data, size_t size) -> size_t {
+        State& s = *state;
+        size_t filled = 0;
+        while (filled < size) {
+            if (s.remaining == 0) {
+                s.file.close();
+                while (s.next < sources.size() && sources[s.next].entry.directory)
+                    ++s.next;
+                if (s.next == sources.size()) {
+                    break;
+                }
+                ArchiveEntry& entry = sources[s.next].entry;
+                if (filled > 0 && entry.size <= size && entry.size > size - filled) {
+                    break;
+                }
+                entry.chunk = chunks.size();
+                entry.offset = filled;
+                s.current = &sources[s.next++];
+                s.remaining = entry.size;
+                if (s.remaining == 0) {
+                    continue;
+                }
+                s.file.open(s.current->disk_path, std::ios::binary);
+                if (!s.file) {
+                    throw std::runtime_error("Could not open input file " + s.current->disk_path);
+                }
+            }
+            size_t n = std::min<uint64_t>(size - filled, s.remaining);
+            s.file.read(reinterpret_cast<char*>(data + filled), n);
+            if (size_t(s.file.gcount()) != n) {
+                throw std::runtime_error("File " + s.current->disk_path + " shrank while it was being archived");
+            }
+            filled += n;
+            s.remaining -= n;
+        }
+        if (filled > 0) {
+            ArchiveChunk chunk;
+            chunk.size = filled;
+            chunks.push_back(chunk);
+        }
+        return filled;
+    };
+}
+
+// The end-of-chunks marker, file table, chunk index and trailer that close an
+// archive. `chunks_end` is the offset just past the last chunk.
+Buffer encodeArchiveTable(const std::vector<ArchiveSource>& sources, const std::vector<ArchiveChunk>& chunks,
+                          uint64_t chunks_end) {
+    Buffer out;
+    appendValue<uint32_t>(out, 0);
+    appendValue<uint32_t>(out, sources.size());
+    for (const ArchiveSource& source : sources) {
+        const ArchiveEntry& entry = source.entry;
+        if (entry.path.size() > UINT16_MAX) {
+            throw std::runtime_error("Path too long to archive: " + entry.path);
+        }
+        appendValue<uint16_t>(out, entry.path.size());
+        out.insert(out.end(), entry.path.begin(), entry.path.end());
+        appendValue<uint8_t>(out, entry.directory ? ARCHIVE_DIRECTORY : ARCHIVE_FILE);
+        appendValue<uint32_t>(out, entry.mode);
+        appendValue<int64_t>(out, entry.mtime_ns);
+        appendValue<uint64_t>(out, entry.size);
+        appendValue<uint32_t>(out, entry.chunk);
+        appendValue<uint32_t>(out, entry.offset);
+    }
+    appendValue<uint32_t>(out, chunks.size());
+    for (const ArchiveChunk& chunk : chunks) {
+        appendValue<uint64_t>(out, chunk.offset);
+        appendValue<uint32_t>(out, chunk.size);
+    }
+    appendValue<uint64_t>(out, chunks_end + sizeof(uint32_t));
+    out.insert(out.end(), ARCHIVE_MAGIC, ARCHIVE_MAGIC + sizeof(ARCHIVE_MAGIC));
+    return out;
+}
+
+// True if every component of `path` is a plain name, so it cannot escape the
+// extraction directory.
+bool isSafeArchivePath(const std::string& path) {
+    size_t start = 0;
+    while (true) {
+        size_t end = path.find('/', start);
+        std::string component = path.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        if (end == std::string::npos) {
+            return true;
+        }
+        start = end + 1;
+    }
+}
+
+// Bounds-checked reads from an encoded file table.
+class TableReader {
+public:
+    explicit TableReader(const Buffer& table) : table(table) {}
+
+    template <typename T>
+    T take() {
+        T value;
+        std::memcpy(&value, advance(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    std::string takeString(size_t size) {
+        const unsigned char* bytes = advance(size);
+        return std::string(reinterpret_cast<const char*>(bytes), size);
+    }
+
+private:
+    const Buffer& table;
+    size_t offset = 0;
+
+    const unsigned char* advance(size_t size) {
+        if (size > table.size() - offset) {
+            throw std::runtime_error("Corrupt archive file table.");
+        }
+        const unsigned char* bytes = table.data() + offset;
+        offset += size;
+        return bytes;
+    }
+};
+
+// An archive's file table and chunk index, as read back from its end.
+struct ArchiveTable {
+    FileHeader header;
+    std::vector<ArchiveEntry> entries;
+    std::vector<ArchiveChunk> chunks;
+    uint64_t chunks_end = 0; // Offset of the end-of-chunks marker.
+};
+
+// Reads the file table of the archive starting at the current position of
+// `in`, then seeks back there.
+ArchiveTable readArchiveTable(std::istream& in) {
+    std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg() - start;
+    if (start < 0 || size < std::streamoff(FILE_HEADER_SIZE + ARCHIVE_TRAILER_SIZE)) {
+        throw std::runtime_error("Not an archive, or the input is not seekable.");
+    }
+
+    ArchiveTable result;
+    FileHeader& header = result.header;
+    unsigned char header_bytes[FILE_HEADER_SIZE];
+    in.seekg(start);
+    in.read(reinterpret_cast<char*>(header_bytes), sizeof(header_bytes));
+    if (!in || !decodeFileHeader(header_bytes, header) || !(header.flags & FLAG_ARCHIVE)) {
+        throw std::runtime_error("Not an archive.");
+    }
+    if (header.flags & ~KNOWN_FLAGS) {
+        throw std::runtime_error("Unsupported container flags.");
+    }
+
+    unsigned char trailer[ARCHIVE_TRAILER_SIZE];
+    in.seekg(start + std::streamoff(size - ARCHIVE_TRAILER_SIZE));
+    in.read(reinterpret_cast<char*>(trailer), sizeof(trailer));
+    uint64_t table_offset;
+    std::memcpy(&table_offset, trailer, sizeof(table_offset));
+    if (!in || std::memcmp(trailer + sizeof(table_offset), ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+        table_offset < FILE_HEADER_SIZE + sizeof(uint32_t) || table_offset > uint64_t(size) - ARCHIVE_TRAILER_SIZE) {
+        throw std::runtime_error("Archive file table is missing. File may be truncated.");
+    }
+
+    Buffer table(size - ARCHIVE_TRAILER_SIZE - table_offset);
+    in.seekg(start + std::streamoff(table_offset));
+    in.read(reinterpret_cast<char*>(table.data()), table.size());
+    if (!in) {
+        throw std::runtime_error("Failed to read archive file table.");
+    }
+    in.seekg(start);
+
+    result.chunks_end = table_offset - sizeof(uint32_t);
+    TableReader reader(table);
+    uint32_t count = reader.take<uint32_t>();
+    for (uint32_t i = 0; i < count; ++i) {
+        ArchiveEntry entry;
+        entry.path = reader.takeString(reader.take<uint16_t>());
+        uint8_t type = reader.take<uint8_t>();
+        entry.mode = reader.take<uint32_t>();
+        entry.mtime_ns = reader.take<int64_t>();
+        entry.size = reader.take<uint64_t>();
+        entry.chunk = reader.take<uint32_t>();
+        entry.offset = reader.take<uint32_t>();
+        if ((type != ARCHIVE_FILE && type != ARCHIVE_DIRECTORY) || !isSafeArchivePath(entry.path)) {
+            throw std::runtime_error("Corrupt archive file table.");
+        }
+        entry.directory = type == ARCHIVE_DIRECTORY;
+        result.entries.push_back(std::move(entry));
+    }
+    uint32_t chunk_count = reader.take<uint32_t>();
+    uint64_t previous_end = FILE_HEADER_SIZE;
+    for (uint32_t i = 0; i < chunk_count; ++i) {
+        ArchiveChunk chunk;
+        chunk.offset = reader.take<uint64_t>();
+        chunk.size = reader.take<uint32_t>();
+        // Chunks are contiguous and in order, each at least a size prefix long.
+        if (chunk.offset < previous_end || chunk.size == 0 || chunk.size > header.chunk_size) {
+            throw std::runtime_error("Corrupt archive chunk index.");
+        }
+        previous_end = chunk.offset + sizeof(uint32_t);
+        result.chunks.push_back(chunk);
+    }
+    if (previous_end > result.chunks_end) {
+        throw std::runtime_error("Corrupt archive chunk index.");
+    }
+    return result;
+}
+
+// Applies an entry's permissions and modification time to `path`.
+void restoreMetadata(const fs::path& path, const ArchiveEntry& entry) {
+    timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT; // Leave the access time alone.
+    times[1].tv_sec = entry.mtime_ns / NANOSECONDS_PER_SECOND;
+    times[1].tv_nsec = entry.mtime_ns % NANOSECONDS_PER_SECOND;
+    if (times[1].tv_nsec < 0) {
+        times[1].tv_sec -= 1;
+        times[1].tv_nsec += NANOSECONDS_PER_SECOND;
+    }
+    if (::chmod(path.c_str(), entry.mode) != 0 || ::utimensat(AT_FDCWD, path.c_str(), times, 0) != 0) {
+        throw std::runtime_error("Could not set attributes of " + path.string() + ": " + std::strerror(errno));
+    }
+}
+
+// Splits the decompressed archive stream back into files, in table order.
+class ArchiveWriter {
+public:
+    ArchiveWriter(const std::vector<ArchiveEntry>& entries, fs::path root) : entries(entries), root(std::move(root)) {}
+
+    void write(const unsigned char* data, size_t size) {
+        while (size > 0) {
+            if (remaining == 0 && !openNext()) {
+                throw std::runtime_error("Archive holds more data than its file table lists.");
+            }
+            size_t n = std::min<uint64_t>(size, remaining);
+            if (!file.write(reinterpret_cast<const char*>(data), n)) {
+                throw std::runtime_error("Write failed for " + (root / current->path).string());
+            }
+            data += n;
+            size -= n;
+            remaining -= n;
+        }
+    }
+
+    // Closes the last file, creates any empty ones after it and applies the
+    // directories' attributes, deepest first so restoring a parent's mtime or
+    // a read-only mode comes after its children are written.
+    void finish() {
+        if (remaining != 0 || openNext()) {
+            throw std::runtime_error("Archive data ends before " + current->path + ". File may be truncated.");
+        }
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+            if (it->directory) restoreMetadata(root / it->path, *it);
+    }
+
+private:
+    const std::vector<ArchiveEntry>& entries;
+    fs::path root;
+    size_t next = 0;
+    const ArchiveEntry* current = nullptr;
+    std::ofstream file;
+    uint64_t remaining = 0;
+
+    // Finishes the current file and opens the next one with data, creating
+    // empty files on the way. Returns false at the end of the table.
+    bool openNext() {
+        closeCurrent();
+        while (next < entries.size()) {
+            const ArchiveEntry& entry = entries[next++];
+            if (entry.directory) {
+                continue;
+            }
+            current = &entry;
+            // Replace rather than rewrite an existing file, which may be read-only.
+            ::unlink((root / entry.path).c_str());
+            file.open(root / entry.path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                throw std::runtime_error("Could not open output file " + (root / entry.path).string());
+            }
+            remaining = entry.size;
+            if (remaining > 0) {
+                return true;
+            }
+            closeCurrent();
+        }
+        return false;
+    }
+
+    void closeCurrent() {
+        if (!file.is_open()) {
+            return;
+        }
+        file.close();
+        if (!file) {
+            throw std::runtime_error("Write failed for " + (root / current->path).string());
+        }
+        restoreMetadata(root / current->path, *current);
+    }
+};
+
+} // namespace
+
+void Compressor::compressFiles(const std::vector<std::string>& paths, std::ostream& out, RunStats* stats,
+                               ProgressReporter* progress) {
+    if (impl->options.content_defined) {
+        throw std::runtime_error("Archives pack files into chunks themselves; content-defined chunking does not apply");
+    }
+    if (impl->options.chunk_index) {
+        throw std::runtime_error("Archives have their own chunk table and cannot carry a chunk index");
+    }
+    std::vector<ArchiveSource> sources = collectSources(paths);
+    std::vector<ArchiveChunk> chunks;
+    std::vector<uint64_t> chunk_offsets;
+    RunStats local;
+    RunStats& run_stats = stats ? *stats : local;
+    Sink write = streamWriter(out);
+    impl->run(archiveReader(sources, chunks), write, run_stats, progress, FLAG_ARCHIVE, &chunk_offsets);
+    for (size_t i = 0; i < chunks.size(); ++i)
+        chunks[i].offset = chunk_offsets[i];
+
+    Buffer table = encodeArchiveTable(sources, chunks, run_stats.bytes_out);
+    write(table.data(), table.size());
+    run_stats.bytes_out += table.size();
+    flushStream(out);
+}
+
+std::vector<ArchiveEntry> Decompressor::listFiles(std::istream& in) {
+    return readArchiveTable(in).entries;
+}
+
+void Decompressor::extractFiles(std::istream& in, const std::string& directory, RunStats* stats,
+                                ProgressReporter* progress) {
+    std::vector<ArchiveEntry> entries = readArchiveTable(in).entries;
+    fs::path root(directory);
+    try {
+        fs::create_directories(root);
+        for (const ArchiveEntry& entry : entries)
+            fs::create_directories(entry.directory ? root / entry.path : (root / entry.path).parent_path());
+    } catch (const fs::filesystem_error& e) {
+        throw std::runtime_error(e.what());
+    }
+
+    ArchiveWriter writer(entries, root);
+    RunStats local;
+    impl->run(streamReader(in), [&writer](const unsigned char* data, size_t size) { writer.write(data, size); },
+              stats ? *stats : local, progress, streamFetcher(in, in.tellg()));
+    writer.finish();
+}
+
+Buffer Decompressor::extractFile(std::istream& in, const std::string& path, RunStats* stats) {
+    std::streampos start = in.tellg();
+    ArchiveTable table = readArchiveTable(in);
+    auto entry = std::find_if(table.entries.begin(), table.entries.end(),
+                              [&path](const ArchiveEntry& e) { return !e.directory && e.path == path; });
+    if (entry == table.entries.end()) {
+        throw std::runtime_error("No file " + path + " in archive.");
+    }
+    Buffer result;
+    result.reserve(entry->size);
+    if (entry->size == 0) {
+        return result;
+    }
+
+    // Find the chunks the file spans; a file that fits in one chunk only needs that one.
+    size_t first = entry->chunk;
+    size_t last = first;
+    uint64_t spanned = 0;
+    while (last < table.chunks.size() && (last == first || spanned < entry->offset + entry->size)) {
+        spanned += table.chunks[last++].size;
+    }
+    if (first >= table.chunks.size() || spanned < entry->offset + entry->size) {
+        throw std::runtime_error("Corrupt archive file table.");
+    }
+    uint64_t begin = table.chunks[first].offset;
+    uint64_t end = last < table.chunks.size() ? table.chunks[last].offset : table.chunks_end;
+
+    // Inflate just those chunks, behind a copy of the archive's header, and keep
+    // the file's bytes.
+    unsigned char header_bytes[FILE_HEADER_SIZE];
+    encodeFileHeader(table.header, header_bytes);
+    in.seekg(start + std::streamoff(begin));
+    ReadFn read_chunks = streamReader(in);
+    uint64_t header_left = FILE_HEADER_SIZE;
+    uint64_t chunks_left = end - begin;
+    ReadFn read = [&](unsigned char* data, size_t size) -> size_t {
+        size_t n = 0;
+        if (header_left > 0) {
+            n = std::min<uint64_t>(size, header_left);
+            std::memcpy(data, header_bytes + FILE_HEADER_SIZE - header_left, n);
+            header_left -= n;
+        } else if (chunks_left > 0) {
+            n = read_chunks(data, std::min<uint64_t>(size, chunks_left));
+            chunks_left -= n;
+        }
+        return n;
+    };
+    uint64_t skip = entry->offset;
+    uint64_t wanted = entry->size;
+    Sink write = [&](const unsigned char* data, size_t size) {
+        size_t skipped = std::min<uint64_t>(size, skip);
+        skip -= skipped;
+        size_t n = std::min<uint64_t>(size - skipped, wanted);
+        result.insert(result.end(), data + skipped, data + skipped + n);
+        wanted -= n;
+    };
+    RunStats local;
+    impl->run(read, write, stats ? *stats : local, nullptr, streamFetcher(in, start));
+    in.clear();
+    in.seekg(start);
+    return result;
+}
+
+namespace {
+
+// Reads exactly `size` bytes at `offset` of `fd`, or throws.
+void readAt(int fd, const std::string& path, uint64_t offset, unsigned char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to read " + path + ": " +
+                                     (n < 0 ? std::strerror(errno) : "unexpected end of file"));
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+// Loads the chunk index of the container open as `fd`, keyed by content. Its
+// chunks must have been compressed with the dictionary `dictionary_id` names.
+std::unordered_map<ChunkDigest, IndexEntry, ChunkDigestHash> readChunkIndex(int fd, const std::string& path,
+                                                                            uint32_t dictionary_id) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        throw std::runtime_error("Could not stat " + path + ": " + std::strerror(errno));
+    }
+    uint64_t file_size = st.st_size;
+    unsigned char header_bytes[FILE_HEADER_SIZE];
+    FileHeader header;
+    bool indexed = file_size >= FILE_HEADER_SIZE + INDEX_TRAILER_SIZE;
+    if (indexed) {
+        readAt(fd, path, 0, header_bytes, sizeof(header_bytes));
+        indexed = decodeFileHeader(header_bytes, header) && (header.flags & FLAG_CHUNK_INDEX);
+    }
+    if (!indexed) {
+        throw std::runtime_error(path + " has no chunk index. Compress it with --index to use it as a base.");
+    }
+    if (header.flags & ~KNOWN_FLAGS) {
+        throw std::runtime_error(path + " has unsupported container flags.");
+    }
+    // Its chunks are copied as they are, so they must decode the same way as the new ones.
+    if ((header.flags & FLAG_DELTA) || header.dictionary_id != dictionary_id) {
+        throw std::runtime_error(path + " was compressed against a different dictionary or reference.");
+    }
+
+    unsigned char trailer[INDEX_TRAILER_SIZE];
+    readAt(fd, path, file_size - INDEX_TRAILER_SIZE, trailer, sizeof(trailer));
+    uint64_t index_offset;
+    uint32_t count;
+    std::memcpy(&index_offset, trailer, sizeof(index_offset));
+    std::memcpy(&count, trailer + 8, sizeof(count));
+    uint64_t index_end = file_size - INDEX_TRAILER_SIZE;
+    if (std::memcmp(trailer + 12, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || index_offset < FILE_HEADER_SIZE ||
+        index_offset > index_end || index_end - index_offset != uint64_t(count) * INDEX_ENTRY_SIZE) {
+        throw std::runtime_error("Corrupt chunk index in " + path + ".");
+    }
+
+    Buffer table(index_end - index_offset);
+    readAt(fd, path, index_offset, table.data(), table.size());
+    std::unordered_map<ChunkDigest, IndexEntry, ChunkDigestHash> chunks;
+    chunks.reserve(count);
+    for (const unsigned char* p = table.data(); p != table.data() + table.size(); p += INDEX_ENTRY_SIZE) {
+        IndexEntry entry;
+        std::memcpy(&entry.data_offset, p, sizeof(entry.data_offset));
+        std::memcpy(&entry.compressed_size, p + 8, sizeof(entry.compressed_size));
+        std::memcpy(&entry.raw_size, p + 12, sizeof(entry.raw_size));
+        std::memcpy(&entry.digest.low, p + 16, sizeof(entry.digest.low));
+        std::memcpy(&entry.digest.high, p + 24, sizeof(entry.digest.high));
+        if (entry.compressed_size == 0 || entry.raw_size > MAX_CHUNK_SIZE || entry.data_offset > index_offset ||
+            entry.compressed_size > index_offset - entry.data_offset) {
+            throw std::runtime_error("Corrupt chunk index in " + path + ".");
+        }
+        chunks.emplace(entry.digest, entry);
+    }
+    return chunks;
+}
+
+// Buffered output to a new file that can also take byte ranges of another
+// file, copied in the kernel with copy_file_range where it is supported.
+class FileOutput {
+public:
+    explicit FileOutput(const std::string& path)
+        : path(path), fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) {
+        if (fd < 0) {
+            throw std::runtime_error("Could not open output file " + path + ": " + std::strerror(errno));
+        }
+        pending.reserve(BUFFER_SIZE);
+    }
+
+    ~FileOutput() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    FileOutput(const FileOutput&) = delete;
+    FileOutput& operator=(const FileOutput&) = delete;
+
+    void write(const unsigned char* data, size_t size) {
+        if (pending.size() + size > BUFFER_SIZE) {
+            flush();
+        }
+        if (size >= BUFFER_SIZE) {
+            writeAll(data, size);
+        } else {
+            pending.insert(pending.end(), data, data + size);
+        }
+    }
+
+    // Appends `size` bytes of `source` starting at `offset`.
+    void copyFrom(int source, const std::string& source_path, uint64_t offset, size_t size) {
+        flush();
+        while (size > 0 && copy_in_kernel) {
+            loff_t from = offset;
+            ssize_t n = ::copy_file_range(source, &from, fd, nullptr, size, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                // Old kernel or unsupported file systems: copy through user space from now on.
+                copy_in_kernel = false;
+                break;
+            }
+            if (n <= 0) {
+                throw std::runtime_error("Failed to copy from " + source_path + ": " +
+                                         (n < 0 ? std::strerror(errno) : "unexpected end of file"));
+            }
+            offset += n;
+            size -= n;
+        }
+        while (size > 0) {
+            size_t n = std::min(size, BUFFER_SIZE);
+            pending.resize(n);
+            readAt(source, source_path, offset, pending.data(), n);
+            flush();
+            offset += n;
+            size -= n;
+        }
+    }
+
+    // Writes out anything buffered and closes the file, reporting errors.
+    void finish() {
+        flush();
+        int closing = fd;
+        fd = -1;
+        if (::close(closing) != 0) {
+            throw std::runtime_error("Write failed for " + path + ": " + std::strerror(errno));
+        }
+    }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+    std::string path;
+    int fd;
+    Buffer pending;
+    bool copy_in_kernel = true;
+
+    void flush() {
+        writeAll(pending.data(), pending.size());
+        pending.clear();
+    }
+
+    void writeAll(const unsigned char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error("Write failed for " + path + ": " + std::strerror(errno));
+            }
+            data += n;
+            size -= n;
+        }
+    }
+};
+
+} // namespace
+
+void Compressor::compressIncremental(std::istream& in, const std::string& output_path, const std::string& base_path,
+                                     RunStats* stats, ProgressReporter* progress) {
+    if (impl->reference) {
+        throw std::runtime_error("Incremental output copies chunks of the base as they are and cannot use a reference");
+    }
+    int base_fd = ::open(base_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (base_fd < 0) {
+        throw std::runtime_error("Could not open base " + base_path + ": " + std::strerror(errno));
+    }
+    // Closes the base however we leave.
+    struct BaseCloser {
+        int fd;
+        ~BaseCloser() { ::close(fd); }
+    } base_closer{base_fd};
+
+    BaseContainer base;
+    base.chunks = readChunkIndex(base_fd, base_path, impl->dictionary_id);
+    struct stat base_stat;
+    struct stat output_stat;
+    if (::fstat(base_fd, &base_stat) == 0 && ::stat(output_path.c_str(), &output_stat) == 0 &&
+        base_stat.st_dev == output_stat.st_dev && base_stat.st_ino == output_stat.st_ino) {
+        throw std::runtime_error("The output " + output_path + " is the base itself.");
+    }
+
+    FileOutput output(output_path);
+    base.copy = [&output, base_fd, &base_path](const IndexEntry& chunk) {
+        output.copyFrom(base_fd, base_path, chunk.data_offset, chunk.compressed_size);
+    };
+    RunStats local;
+    impl->run(impl->chunkReader(streamReader(in)),
+              [&output](const unsigned char* data, size_t size) { output.write(data, size); }, stats ? *stats : local,
+              progress, FLAG_CHUNK_INDEX, nullptr, &base);
+    output.finish();
+}
+
+bool isArchive(std::istream& in) {
+    std::streampos start = in.tellg();
+    if (start == std::streampos(-1)) {
+        // A pipe: peeking would lose the header, and archives need seeking anyway.
+        return false;
+    }
+    unsigned char bytes[FILE_HEADER_SIZE];
+    FileHeader header;
+    bool archive = in.read(reinterpret_cast<char*>(bytes), sizeof(bytes)) && decodeFileHeader(bytes, header) &&
+                   (header.flags & FLAG_ARCHIVE);
+    in.clear();
+    in.seekg(start);
+    return archive;
+}
+
+Buffer trainDictionary(const std::vector<Buffer>& samples, size_t size) {
+    return ::trainDictionary(samples, size);
+}
+
+Buffer compress(const unsigned char* data, size_t size, const Options& options) {
+    return Compressor(options).compress(data, size);
+}
+
+Buffer decompress(const unsigned char* data, size_t size, const Options& options) {
+    return Decompressor(options).decompress(data, size);
+}
+
+} // namespace mtc
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <memory>    // For std::unique_ptr
+#include <ostream>
+#include <string>
+#include <vector>
+#include "buffer_pool.h"
+#include "container_format.h"
+#include "progress.h"
+#include "stats.h"
+
+// libmtcompress: the chunked multithreaded zlib container as a library. The
+// compressor and decompressor command-line tools are thin wrappers around it.
+//
+// Errors (I/O failures, corrupt input, bad options) are reported by throwing
+// std::runtime_error. The library never prints anything.
+
+namespace mtc {
+
+using Buffer = std::vector<unsigned char>;
+
+// Receives compressed output in order, on the thread that called into the library.
+using Sink = std::function<void(const unsigned char* data, size_t size)>;
+
+// Settings shared by Compressor and Decompressor. The defaults match the tools.
+struct Options {
+    size_t threads = 0;      // Worker count; 0 sizes the pool from the affinity mask and cgroup quota.
+    std::vector<int> cpus;   // CPUs to pin workers to; empty leaves them unpinned.
+    bool numa = false;       // Pin one worker group per NUMA node with node-local buffers.
+    bool huge_pages = false; // Back the chunk buffer pools with huge pages.
+    size_t chunk_size = DEFAULT_CHUNK_SIZE;
+    int level = -1;          // zlib level 0-9; -1 is Z_DEFAULT_COMPRESSION.
+    bool perf_counters = false; // Count cycles, instructions and misses around each chunk.
+    size_t max_jobs = 4;     // Compressor jobs that may run at once; each has its own chunk buffers.
+    // Cut chunks where the content says (Gear rolling hash) rather than every
+    // chunk_size bytes, so an insert or delete only changes the chunks around
+    // it. chunk_size, rounded down to a power of two, becomes the average; sizes
+    // range from a quarter of it to four times it. Streams written through
+    // StreamingCompressor keep fixed boundaries.
+    bool content_defined = false;
+    // Store each distinct chunk once: workers hash every chunk, and a chunk
+    // identical to an earlier one is not compressed but written as a reference
+    // to it. The table of seen chunks grows with the input, about 64 bytes per
+    // distinct chunk. Reading such a container back needs seekable input.
+    bool dedup = false;
+    // Append an index of every chunk's content digest and location, so the
+    // container can be the base of a later compressIncremental(). Archives
+    // cannot have one, and compressBatch() writes single-chunk inputs without.
+    bool chunk_index = false;
+    // Flush deflate at content-defined points inside every chunk, as gzip
+    // --rsyncable does, so a small edit only changes the compressed bytes near
+    // it and rsync can send compressed files as cheap deltas. Costs under 1%
+    // of ratio on text. The output is an ordinary container.
+    bool rsyncable = false;
+    // Compress against this file, typically an older version of the input:
+    // content found in it costs a few bytes per match instead of being stored
+    // again. Decompressing needs the same file, given the same way. The file is
+    // mapped and indexed when the Compressor or Decompressor is constructed.
+    // Cannot be combined with rsyncable or compressIncremental().
+    std::string reference;
+    // Preload every chunk's window with this dictionary, as made by
+    // trainDictionary(). Small chunks compress much better with one trained on
+    // similar data. Only its last 32 KB are used. Decompressing needs the same
+    // file. Cannot be combined with reference.
+    std::string dictionary;
+    // If set, choose each chunk's level anew, from 0 to 9, to compress at
+    // least this many MB/s of input with the best ratio that allows; `level`
+    // is then ignored. The speed of each level is learned from the chunks
+    // compressed at it, and the level also drops when the workers fall behind,
+    // as when other jobs share them. compressBatch() keeps `level`.
+    double target_mbps = 0;
+};
+
+// One file or directory stored in an archive.
+struct ArchiveEntry {
+    std::string path;       // Relative and '/'-separated, e.g. "logs/app.log".
+    bool directory = false;
+    uint32_t mode = 0;      // Permission bits.
+    int64_t mtime_ns = 0;   // Modification time, nanoseconds since the epoch.
+    uint64_t size = 0;      // Uncompressed bytes; 0 for directories.
+    uint32_t chunk = 0;     // Chunk holding the start of the data.
+    uint32_t offset = 0;    // Where the data starts in that chunk's uncompressed bytes.
+};
+
+// A reusable compression engine. The worker threads are created once by the
+// constructor and shared by every compress() call, so compressing many small
+// inputs does not pay thread setup each time. Calls may come from several
+// threads at once: each runs as its own job, and workers take chunks from the
+// running jobs in turn. Every running job needs a window of chunk buffers;
+// these are kept for reuse, and once `max_jobs` are in use further calls wait.
+class Compressor {
+public:
+    explicit Compressor(const Options& options = Options());
+    ~Compressor();
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    // Streams `in` to `out` in bounded memory. If given, `stats` is overwritten
+    // with this call's figures and `progress` receives uncompressed bytes as
+    // chunks complete.
+    void compress(std::istream& in, std::ostream& out, RunStats* stats = nullptr,
+                  ProgressReporter* progress = nullptr);
+
+    // Compresses an in-memory buffer into a complete container.
+    Buffer compress(const unsigned char* data, size_t size, RunStats* stats = nullptr);
+    Buffer compress(const Buffer& data, RunStats* stats = nullptr) { return compress(data.data(), data.size(), stats); }
+
+    // Compresses many independent inputs, each into its own container. Inputs
+    // that fit in one chunk are queued to the workers together as one batch,
+    // which is far cheaper than a compress() call each. Larger inputs go
+    // through the normal pipeline.
+    std::vector<Buffer> compressBatch(const std::vector<Buffer>& inputs);
+
+    // Compresses `in` into a new file at `output_path`, copying the compressed
+    // bytes of every chunk whose content is also in `base_path` rather than
+    // compressing it again. The base is an earlier container with a chunk index,
+    // typically the previous snapshot of the same data: fixed chunks suit data
+    // changed in place, content_defined suits data that also shifts. Copies use
+    // copy_file_range, so they stay in the kernel. The output is indexed too,
+    // ready to be the next run's base, and must not be the base itself.
+    void compressIncremental(std::istream& in, const std::string& output_path, const std::string& base_path,
+                             RunStats* stats = nullptr, ProgressReporter* progress = nullptr);
+
+    // Archives files and directory trees into one container. Each path is stored
+    // relative to its parent directory, as tar does, and directories are walked
+    // recursively in sorted order. Every file's data passes through the same
+    // chunk pipeline back to back, so a tree of many small files still keeps
+    // every worker busy. Small files are packed into solid chunks: one that fits
+    // in a chunk never straddles two, so it can be extracted by inflating a
+    // single chunk. Symbolic links and special files are skipped. `progress`
+    // receives uncompressed bytes.
+    void compressFiles(const std::vector<std::string>& paths, std::ostream& out, RunStats* stats = nullptr,
+                       ProgressReporter* progress = nullptr);
+
+    const Options& options() const;
+    size_t threads() const;   // Total worker threads across all nodes.
+    size_t numaNodes() const; // 1 unless NUMA placement is active.
+    PageBacking pageBacking() const;
+
+    struct Impl;
+
+private:
+    friend class StreamingCompressor;
+    friend class Decompressor;
+    std::unique_ptr<Impl> impl;
+};
+
+// Push interface for producers that generate data incrementally. write() copies
+// into chunk buffers and hands each full chunk to the Compressor's workers, and
+// compressed chunks reach the sink in order from inside write(), flush() and
+// finish(). Only the Compressor's in-flight window is buffered, so write()
+// blocks while the workers or the sink fall behind.
+//
+// The stream counts as a running job on its Compressor until finish(). If a
+// call throws the stream is unusable and its output incomplete. Destroying an
+// unfinished stream discards buffered data.
+class StreamingCompressor {
+public:
+    StreamingCompressor(Compressor& compressor, Sink sink, RunStats* stats = nullptr);
+    ~StreamingCompressor();
+
+    StreamingCompressor(const StreamingCompressor&) = delete;
+    StreamingCompressor& operator=(const StreamingCompressor&) = delete;
+
+    void write(const unsigned char* data, size_t size);
+    void write(const Buffer& data) { write(data.data(), data.size()); }
+
+    // Compresses any partial chunk now and delivers everything written so far
+    // to the sink. Each flush ends a chunk early, so frequent flushes cost ratio.
+    void flush();
+
+    // Flushes and completes the container. `stats`, if given, is filled in here.
+    void finish();
+
+    struct State;
+
+private:
+    std::unique_ptr<State> state;
+};
+
+// Decodes containers written by Compressor, including legacy headerless files.
+// Chunks are read and written in order on the calling thread and inflated in
+// parallel, on a persistent worker pool sized like the Compressor's or on a
+// Compressor's own workers. `numa`, `huge_pages`, `chunk_size` and `level` are
+// not used. Calls may come from several threads at once. decompress() on an
+// archive yields its files' contents concatenated.
+class Decompressor {
+public:
+    explicit Decompressor(const Options& options = Options());
+
+    // Runs on `shared`'s worker threads instead of starting its own, so one
+    // pool serves both directions. `shared` must outlive the Decompressor.
+    explicit Decompressor(Compressor& shared);
+
+    ~Decompressor();
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Streams `in` to `out`. `progress` receives compressed bytes as they are consumed.
+    void decompress(std::istream& in, std::ostream& out, RunStats* stats = nullptr,
+                    ProgressReporter* progress = nullptr);
+
+    Buffer decompress(const unsigned char* data, size_t size, RunStats* stats = nullptr);
+    Buffer decompress(const Buffer& data, RunStats* stats = nullptr) { return decompress(data.data(), data.size(), stats); }
+
+    // Reads an archive's file table. `in` must be seekable.
+    std::vector<ArchiveEntry> listFiles(std::istream& in);
+
+    // Recreates an archive's files under `directory`, creating it if needed,
+    // and restores their permissions and modification times. `in` must be
+    // seekable. Entries that would land outside `directory` are rejected.
+    void extractFiles(std::istream& in, const std::string& directory, RunStats* stats = nullptr,
+                      ProgressReporter* progress = nullptr);
+
+    // Returns the contents of one archived file, inflating only the chunks it
+    // spans. `in` must be seekable.
+    Buffer extractFile(std::istream& in, const std::string& path, RunStats* stats = nullptr);
+
+    size_t threads() const;
+
+    struct Impl;
+
+private:
+    std::unique_ptr<Impl> impl;
+};
+
+// Trains a dictionary for Options::dictionary of up to `size` bytes (at most
+// 32 KB) from sample chunks of the data it is meant for. See dictionary.h.
+Buffer trainDictionary(const std::vector<Buffer>& samples, size_t size = 32 * 1024);
+
+// True if `in` starts with an archive header. The read position is restored.
+bool isArchive(std::istream& in);
+
+// One-shot helpers that build a temporary engine for a single buffer.
+Buffer compress(const unsigned char* data, size_t size, const Options& options = Options());
+Buffer decompress(const unsigned char* data, size_t size, const Options& options = Options());
+
+} // namespace mtc
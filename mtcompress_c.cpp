@@ -0,0 +1,241 @@
+#include "mtcompress_c.h"
+#include <algorithm> // For std::min
+#include <cstddef>   // For offsetof
+#include <cstdlib>   // For std::malloc, std::free
+#include <cstring>   // For std::memcpy
+#include <exception>
+#include <memory>    // For std::unique_ptr
+#include <string>
+#include "mtcompress.h"
+
+// No exception may cross the C boundary: every entry point catches, records
+// the message for mtc_last_error() and returns a status instead.
+
+struct mtc_context {
+    mtc::Compressor compressor;
+    mtc::Decompressor decompressor;
+
+    // Both directions share the compressor's worker threads.
+    explicit mtc_context(const mtc::Options& options) : compressor(options), decompressor(compressor) {}
+};
+
+struct mtc_stream {
+    mtc::Buffer pending; // Compressed bytes not yet pulled, starting at `offset`.
+    size_t offset = 0;
+    std::unique_ptr<mtc::StreamingCompressor> compressor;
+    bool finished = false;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+int fail(int status, const std::string& message) {
+    last_error = message;
+    return status;
+}
+
+// Copies `buffer` into memory the caller releases with mtc_free().
+int exportBuffer(const mtc::Buffer& buffer, void** out, size_t* out_size) {
+    // malloc(0) may return NULL, which callers would mistake for failure.
+    void* memory = std::malloc(buffer.empty() ? 1 : buffer.size());
+    if (!memory) {
+        return fail(MTC_ERROR, "Out of memory");
+    }
+    if (!buffer.empty()) {
+        std::memcpy(memory, buffer.data(), buffer.size());
+    }
+    *out = memory;
+    *out_size = buffer.size();
+    return MTC_OK;
+}
+
+// True if the caller's mtc_options, of options->struct_size bytes, has `field`.
+#define HAS_OPTION(options, field) \
+    ((options)->struct_size >= offsetof(mtc_options, field) + sizeof((options)->field))
+
+} // namespace
+
+extern "C" {
+
+void mtc_options_init(mtc_options* options) {
+    if (!options) {
+        return;
+    }
+    mtc::Options defaults;
+    options->struct_size = sizeof(mtc_options);
+    options->threads = defaults.threads;
+    options->chunk_size = defaults.chunk_size;
+    options->level = defaults.level;
+    options->numa = defaults.numa;
+    options->huge_pages = defaults.huge_pages;
+    options->max_jobs = defaults.max_jobs;
+}
+
+mtc_context* mtc_context_create(const mtc_options* options) {
+    mtc::Options settings;
+    if (options) {
+        if (!HAS_OPTION(options, huge_pages)) {
+            fail(MTC_INVALID_ARGUMENT, "Invalid argument: options not filled by mtc_options_init()");
+            return nullptr;
+        }
+        settings.threads = options->threads;
+        settings.chunk_size = options->chunk_size;
+        settings.level = options->level;
+        settings.numa = options->numa != 0;
+        settings.huge_pages = options->huge_pages != 0;
+        if (HAS_OPTION(options, max_jobs)) {
+            settings.max_jobs = options->max_jobs;
+        }
+    }
+    try {
+        return new mtc_context(settings);
+    } catch (const std::exception& e) {
+        fail(MTC_ERROR, e.what());
+        return nullptr;
+    } catch (...) {
+        fail(MTC_ERROR, "Unknown error");
+        return nullptr;
+    }
+}
+
+void mtc_context_destroy(mtc_context* context) {
+    delete context;
+}
+
+int mtc_compress(mtc_context* context, const void* data, size_t size, void** out, size_t* out_size) {
+    if (!context || (!data && size) || !out || !out_size) {
+        return fail(MTC_INVALID_ARGUMENT, "Invalid argument");
+    }
+    try {
+        return exportBuffer(context->compressor.compress(static_cast<const unsigned char*>(data), size), out, out_size);
+    } catch (const std::exception& e) {
+        return fail(MTC_ERROR, e.what());
+    } catch (...) {
+        return fail(MTC_ERROR, "Unknown error");
+    }
+}
+
+int mtc_decompress(mtc_context* context, const void* data, size_t size, void** out, size_t* out_size) {
+    if (!context || (!data && size) || !out || !out_size) {
+        return fail(MTC_INVALID_ARGUMENT, "Invalid argument");
+    }
+    try {
+        return exportBuffer(context->decompressor.decompress(static_cast<const unsigned char*>(data), size), out, out_size);
+    } catch (const std::exception& e) {
+        return fail(MTC_ERROR, e.what());
+    } catch (...) {
+        return fail(MTC_ERROR, "Unknown error");
+    }
+}
+
+void mtc_free(void* buffer) {
+    std::free(buffer);
+}
+
+mtc_stream* mtc_stream_create(mtc_context* context) {
+    if (!context) {
+        fail(MTC_INVALID_ARGUMENT, "Invalid argument");
+        return nullptr;
+    }
+    try {
+        auto stream = std::make_unique<mtc_stream>();
+        mtc_stream* target = stream.get();
+        stream->compressor = std::make_unique<mtc::StreamingCompressor>(
+            context->compressor, [target](const unsigned char* data, size_t size) {
+                target->pending.insert(target->pending.end(), data, data + size);
+            });
+        return stream.release();
+    } catch (const std::exception& e) {
+        fail(MTC_ERROR, e.what());
+        return nullptr;
+    } catch (...) {
+        fail(MTC_ERROR, "Unknown error");
+        return nullptr;
+    }
+}
+
+int mtc_stream_push(mtc_stream* stream, const void* data, size_t size) {
+    if (!stream || (!data && size)) {
+        return fail(MTC_INVALID_ARGUMENT, "Invalid argument");
+    }
+    if (stream->finished) {
+        return fail(MTC_STREAM_FINISHED, "Stream already finished");
+    }
+    try {
+        stream->compressor->write(static_cast<const unsigned char*>(data), size);
+        return MTC_OK;
+    } catch (const std::exception& e) {
+        return fail(MTC_ERROR, e.what());
+    } catch (...) {
+        return fail(MTC_ERROR, "Unknown error");
+    }
+}
+
+int mtc_stream_flush(mtc_stream* stream) {
+    if (!stream) {
+        return fail(MTC_INVALID_ARGUMENT, "Invalid argument");
+    }
+    if (stream->finished) {
+        return fail(MTC_STREAM_FINISHED, "Stream already finished");
+    }
+    try {
+        stream->compressor->flush();
+        return MTC_OK;
+    } catch (const std::exception& e) {
+        return fail(MTC_ERROR, e.what());
+    } catch (...) {
+        return fail(MTC_ERROR, "Unknown error");
+    }
+}
+
+int mtc_stream_finish(mtc_stream* stream) {
+    if (!stream) {
+        return fail(MTC_INVALID_ARGUMENT, "Invalid argument");
+    }
+    if (stream->finished) {
+        return fail(MTC_STREAM_FINISHED, "Stream already finished");
+    }
+    try {
+        stream->compressor->finish();
+        stream->finished = true;
+        return MTC_OK;
+    } catch (const std::exception& e) {
+        return fail(MTC_ERROR, e.what());
+    } catch (...) {
+        return fail(MTC_ERROR, "Unknown error");
+    }
+}
+
+size_t mtc_stream_available(const mtc_stream* stream) {
+    return stream ? stream->pending.size() - stream->offset : 0;
+}
+
+size_t mtc_stream_pull(mtc_stream* stream, void* out, size_t capacity) {
+    if (!stream || !out) {
+        return 0;
+    }
+    size_t n = std::min(capacity, stream->pending.size() - stream->offset);
+    if (n == 0) {
+        return 0;
+    }
+    std::memcpy(out, stream->pending.data() + stream->offset, n);
+    stream->offset += n;
+    if (stream->offset * 2 >= stream->pending.size()) {
+        // Drop the pulled prefix once it is at least half the buffer, keeping the
+        // capacity for the next chunks.
+        stream->pending.erase(stream->pending.begin(), stream->pending.begin() + stream->offset);
+        stream->offset = 0;
+    }
+    return n;
+}
+
+void mtc_stream_destroy(mtc_stream* stream) {
+    delete stream;
+}
+
+const char* mtc_last_error(void) {
+    return last_error.c_str();
+}
+
+} // extern "C"
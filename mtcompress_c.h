@@ -0,0 +1,95 @@
+#ifndef MTCOMPRESS_C_H
+#define MTCOMPRESS_C_H
+
+/*
+ * C interface to libmtcompress for use over FFI (ctypes, cgo and the like).
+ *
+ * A context owns a persistent pool of worker threads and chunk buffers, so
+ * create one per process and reuse it for every call. Calls on one context
+ * may come from several threads at once and share its workers fairly.
+ *
+ * Functions returning int return MTC_OK or a negative mtc_status; on failure
+ * mtc_last_error() describes the problem for the calling thread. Buffers
+ * returned through `out` parameters are allocated by the library and must be
+ * released with mtc_free().
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    MTC_OK = 0,
+    MTC_ERROR = -1,            /* Compression or decompression failed; see mtc_last_error(). */
+    MTC_INVALID_ARGUMENT = -2, /* A required pointer was NULL or an option was out of range. */
+    MTC_STREAM_FINISHED = -3   /* The stream was already finished. */
+} mtc_status;
+
+/*
+ * Always fill with mtc_options_init() before setting fields. It records the
+ * size of the struct the caller was compiled with, so a library built with
+ * more options reads only the fields the caller knows about and uses the
+ * defaults for the rest. New fields are only ever appended.
+ */
+typedef struct {
+    size_t struct_size; /* sizeof(mtc_options) as the caller sees it; set by mtc_options_init(). */
+    size_t threads;    /* Worker count; 0 sizes the pool from the affinity mask and cgroup quota. */
+    size_t chunk_size; /* Uncompressed bytes per chunk. */
+    int level;         /* zlib level 0-9, or -1 for the default. */
+    int numa;          /* Non-zero pins one worker group per NUMA node. */
+    int huge_pages;    /* Non-zero backs the chunk buffers with huge pages. */
+    size_t max_jobs;   /* Jobs that may compress at once; further calls wait. */
+} mtc_options;
+
+typedef struct mtc_context mtc_context;
+typedef struct mtc_stream mtc_stream;
+
+/* Fills `options` with the defaults used by the command-line tools. */
+void mtc_options_init(mtc_options* options);
+
+/* Returns NULL on failure. `options` may be NULL for the defaults; a
+ * struct_size too small to hold the first fields is an invalid argument. */
+mtc_context* mtc_context_create(const mtc_options* options);
+void mtc_context_destroy(mtc_context* context);
+
+/* Compresses `size` bytes into a complete container. */
+int mtc_compress(mtc_context* context, const void* data, size_t size, void** out, size_t* out_size);
+
+/* Decompresses a complete container, including legacy headerless files. */
+int mtc_decompress(mtc_context* context, const void* data, size_t size, void** out, size_t* out_size);
+
+void mtc_free(void* buffer);
+
+/*
+ * Streaming compression. Push input as it is produced and pull compressed
+ * bytes as they become available; output is complete once mtc_stream_finish()
+ * has returned and mtc_stream_available() drops to zero. A stream counts
+ * against the context's max_jobs until it is finished or destroyed. Output
+ * not yet pulled is held in memory, so pull regularly. Destroy every stream
+ * before its context. There is no streaming decompression; decompress the
+ * finished container with mtc_decompress().
+ */
+mtc_stream* mtc_stream_create(mtc_context* context);
+int mtc_stream_push(mtc_stream* stream, const void* data, size_t size);
+int mtc_stream_flush(mtc_stream* stream);
+int mtc_stream_finish(mtc_stream* stream);
+
+/* Number of compressed bytes waiting to be pulled. */
+size_t mtc_stream_available(const mtc_stream* stream);
+
+/* Copies up to `capacity` waiting bytes into `out` and returns how many were copied. */
+size_t mtc_stream_pull(mtc_stream* stream, void* out, size_t capacity);
+
+void mtc_stream_destroy(mtc_stream* stream);
+
+/* Message for the most recent failure on the calling thread; never NULL. It stays
+ * valid until the next failing call on that thread. */
+const char* mtc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTCOMPRESS_C_H */
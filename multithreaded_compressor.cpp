@@ -1,200 +1,366 @@
+#include <algorithm> // For std::max
 #include <iostream>
 #include <fstream>
-#include <vector>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <queue>
-#include <functional>
-#include <algorithm> // For std::sort
 #include <stdexcept> // For std::runtime_error
-#include <zlib.h>    // Requires linking with -lz
-
-// Define a constant for the chunk size (1MB).
-const size_t CHUNK_SIZE = 1024 * 1024;
+#include <vector>
+#include <string>
+#include <memory>    // For std::unique_ptr
+#include <filesystem> // For std::filesystem::file_size, std::filesystem::recursive_directory_iterator
+#include "mtcompress.h"
+#include "topology.h"
+#include "trace.h"
+#include "daemon_protocol.h"
 
-// Represents a chunk of data read from the input file.
-struct Chunk {
-    size_t id;
-    std::vector<unsigned char> data;
+// Command-line options for the compressor.
+struct Options {
+    std::vector<std::string> input_paths; // One file, or several files and directories for an archive.
+    std::string output_path;
+    bool archive = false;    // Store input_paths as an archive with a file table.
+    mtc::Options engine;     // Threads, placement, chunk size and level for the library.
+    std::string stats;       // "", "text" or "json".
+    std::string trace_path;  // Chrome trace output; empty disables tracing.
+    bool progress = ProgressReporter::defaultEnabled(); // Live progress on stderr.
+    std::string daemon_socket; // Hand the job to mtcompressd on this socket instead.
+    std::string local_option;  // The last option given that the daemon cannot honour.
+    std::string base_path;   // Earlier indexed output whose unchanged chunks are copied.
+    bool train_dictionary = false; // Write a dictionary trained on the inputs instead of compressing.
 };
 
-// Represents a chunk of data after compression.
-struct CompressedChunk {
-    size_t id;
-    std::vector<unsigned char> data;
-};
+// Bytes of samples to train a dictionary on: over a hundred times its size.
+const uint64_t SAMPLE_BUDGET = 4 * 1024 * 1024;
 
-// A simple and robust thread pool implementation.
-class ThreadPool {
-public:
-    // Constructor: creates a specified number of worker threads.
-    ThreadPool(size_t n) : stop(false) {
-        for (size_t i = 0; i < n; ++i)
-            workers.emplace_back([this]() { this->worker_thread(); });
-    }
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] <input_file> <output_file>\n"
+              << "       " << program << " [options] <file_or_directory>... <output_archive>\n"
+              << "       " << program << " --train-dict [--chunk-size N] <file_or_directory>... <dictionary>\n"
+              << "Several inputs, or a directory, are stored as one archive with a file table.\n"
+              << "Options:\n"
+              << "  --huge-pages    Back chunk buffers with huge pages (hugetlbfs, else THP)\n"
+              << "  --numa          Pin a worker group per NUMA node and keep its buffers node-local\n"
+              << "  --threads N     Number of worker threads (default: allowed CPUs, capped by cgroup quota)\n"
+              << "  --cpus LIST     Pin workers to a CPU list such as 0-3,8\n"
+              << "  --chunk-size N  Uncompressed bytes per chunk (default 1048576)\n"
+              << "  --level N       zlib compression level 0-9 (default 6)\n"
+              << "  --target-mbps N Adapt the level per chunk to compress at least N MB/s, as high as that allows\n"
+              << "  --cdc           Cut chunks at content-defined boundaries averaging --chunk-size\n"
+              << "  --dedup         Store repeated chunks once, as references to the first copy\n"
+              << "  --rsyncable     Flush compression at content-defined points so rsync deltas stay small\n"
+              << "  --index         Append a chunk index so the output can later serve as a --base\n"
+              << "  --base FILE     Copy chunks unchanged since FILE, an earlier indexed output, instead of\n"
+              << "                  compressing them; the new output is indexed too\n"
+              << "  --reference FILE Compress against FILE, such as an older version; decompressing needs it too\n"
+              << "  --dict FILE     Preload each chunk with a dictionary made by --train-dict\n"
+              << "  --train-dict    Train a dictionary on sample chunks of the inputs and write it to the last argument\n"
+              << "  --stats[=FMT]   Report per-phase timings; FMT is text (default) or json\n"
+              << "  --trace FILE    Write a Chrome trace of workers, queue waits and I/O to FILE\n"
+              << "  --progress      Show live progress and ETA on stderr (default when stderr is a terminal)\n"
+              << "  --no-progress   Never show progress\n"
+              << "  --perf-counters Add hardware counters (IPC, cycles/byte) to --stats output\n"
+              << "  --daemon SOCKET Ask the mtcompressd listening on SOCKET to do the work, with its settings\n";
+}
 
-    // Destructor: ensures the thread pool is shut down properly.
-    ~ThreadPool() {
-        shutdown();
+// Parses flags and the two positional file arguments. Returns false on bad usage.
+bool parseArgs(int argc, char* argv[], Options& options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        // The daemon compresses with its own settings and only receives the two paths.
+        if (arg.size() > 1 && arg[0] == '-' && arg != "--daemon" && arg != "--progress" && arg != "--no-progress") {
+            options.local_option = arg;
+        }
+        if (arg == "--huge-pages") {
+            options.engine.huge_pages = true;
+        } else if (arg == "--numa") {
+            options.engine.numa = true;
+        } else if (arg == "--cdc") {
+            options.engine.content_defined = true;
+        } else if (arg == "--dedup") {
+            options.engine.dedup = true;
+        } else if (arg == "--rsyncable") {
+            options.engine.rsyncable = true;
+        } else if (arg == "--index") {
+            options.engine.chunk_index = true;
+        } else if (arg == "--base" && i + 1 < argc) {
+            options.base_path = argv[++i];
+        } else if (arg == "--reference" && i + 1 < argc) {
+            options.engine.reference = argv[++i];
+        } else if (arg == "--dict" && i + 1 < argc) {
+            options.engine.dictionary = argv[++i];
+        } else if (arg == "--train-dict") {
+            options.train_dictionary = true;
+        } else if (arg == "--stats" || arg == "--stats=text" || arg == "--stats=json") {
+            options.stats = arg == "--stats=json" ? "json" : "text";
+        } else if (arg == "--perf-counters") {
+            options.engine.perf_counters = true;
+        } else if (arg == "--progress" || arg == "--no-progress") {
+            options.progress = arg == "--progress";
+        } else if (arg == "--trace" && i + 1 < argc) {
+            options.trace_path = argv[++i];
+        } else if (arg == "--daemon" && i + 1 < argc) {
+            options.daemon_socket = argv[++i];
+        } else if ((arg == "--threads" || arg == "--cpus" || arg == "--chunk-size" || arg == "--level" ||
+                    arg == "--target-mbps") && i + 1 < argc) {
+            std::string value = argv[++i];
+            bool valid = true;
+            try {
+                if (arg == "--target-mbps") {
+                    options.engine.target_mbps = std::stod(value);
+                    valid = options.engine.target_mbps > 0;
+                } else if (arg == "--threads") {
+                    options.engine.threads = std::stoul(value);
+                    valid = options.engine.threads > 0;
+                } else if (arg == "--cpus") {
+                    options.engine.cpus = parseCpuList(value);
+                    valid = !options.engine.cpus.empty();
+                } else if (arg == "--chunk-size") {
+                    options.engine.chunk_size = std::stoul(value);
+                    valid = options.engine.chunk_size > 0 && options.engine.chunk_size <= MAX_CHUNK_SIZE;
+                } else {
+                    options.engine.level = std::stoi(value);
+                    valid = options.engine.level >= 0 && options.engine.level <= 9;
+                }
+            } catch (const std::exception&) {
+                valid = false;
+            }
+            if (!valid) {
+                std::cerr << "Error: Invalid value for " << arg << ": " << value << "\n";
+                return false;
+            }
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Error: Unknown option " << arg << "\n";
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
     }
+    if (positional.size() < 2) {
+        return false;
+    }
+    options.output_path = positional.back();
+    positional.pop_back();
+    options.input_paths = positional;
+    // An unreadable path is not a directory; opening it reports the error.
+    std::error_code error;
+    options.archive = positional.size() > 1 || std::filesystem::is_directory(positional[0], error);
+    return true;
+}
 
-    // Enqueues a new task for the workers to execute.
-    void enqueue(std::function<void()> task) {
-        {
-            std::lock_guard<std::mutex> lock(queue_mutex);
-            if (stop) {
-                // Do not enqueue new tasks if the pool is stopping.
-                return;
-            }
-            tasks.push(std::move(task));
+// Reads chunks spread evenly over the files under `paths`, about SAMPLE_BUDGET
+// bytes in all, to train a dictionary on.
+std::vector<mtc::Buffer> sampleChunks(const std::vector<std::string>& paths, size_t chunk_size) {
+    namespace fs = std::filesystem;
+    std::vector<fs::path> files;
+    for (const std::string& path : paths) {
+        if (!fs::is_directory(path)) {
+            files.push_back(path);
+            continue;
         }
-        condition.notify_one();
+        for (const auto& entry : fs::recursive_directory_iterator(path))
+            if (entry.is_regular_file() && !entry.is_symlink()) files.push_back(entry.path());
     }
+    uint64_t total = 0;
+    for (const fs::path& file : files)
+        total += fs::file_size(file);
+    // Every stride-th chunk of the inputs taken together.
+    uint64_t stride = std::max<uint64_t>(1, total / SAMPLE_BUDGET);
+    uint64_t next = 0;
+    std::vector<mtc::Buffer> samples;
+    for (const fs::path& file : files) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Could not open input file " + file.string());
+        }
+        uint64_t chunks = (fs::file_size(file) + chunk_size - 1) / chunk_size;
+        for (; next < chunks; next += stride) {
+            mtc::Buffer sample(chunk_size);
+            in.seekg(next * chunk_size);
+            in.read(reinterpret_cast<char*>(sample.data()), sample.size());
+            sample.resize(in.gcount());
+            in.clear();
+            samples.push_back(std::move(sample));
+        }
+        next -= chunks;
+    }
+    return samples;
+}
 
-    // Shuts down the thread pool, waiting for all tasks to complete.
-    void shutdown() {
-        if (stop) return; // Already shutting down
-        {
-            std::lock_guard<std::mutex> lock(queue_mutex);
-            stop = true;
+// Sums the sizes of the input files, walking directories, for the progress
+// total. Returns 0 (unknown) if any of them cannot be read.
+uint64_t totalInputBytes(const std::vector<std::string>& paths) {
+    namespace fs = std::filesystem;
+    std::error_code error;
+    uint64_t total = 0;
+    for (const std::string& path : paths) {
+        if (!fs::is_directory(path, error)) {
+            total += fs::file_size(path, error);
+        } else {
+            for (fs::recursive_directory_iterator it(path, error), end; !error && it != end; it.increment(error))
+                if (it->is_regular_file(error) && !it->is_symlink(error)) total += it->file_size(error);
         }
-        condition.notify_all();
-        for (auto& worker : workers) {
-            if (worker.joinable()) {
-                worker.join();
-            }
+        if (error) {
+            return 0;
         }
     }
+    return total;
+}
 
-private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
 
-    // The main loop for each worker thread.
-    void worker_thread() {
-        while (true) {
-            std::function<void()> task;
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                condition.wait(lock, [this] { return this->stop || !this->tasks.empty(); });
-                if (this->stop && this->tasks.empty()) {
-                    return;
-                }
-                task = std::move(tasks.front());
-                tasks.pop();
+    if (!options.daemon_socket.empty()) {
+        std::string error;
+        if (options.archive) {
+            std::cerr << "Error: --daemon compresses single files, not archives\n";
+            return 1;
+        }
+        if (!options.local_option.empty()) {
+            std::cerr << "Error: --daemon compresses with the daemon's own settings; " << options.local_option
+                      << " cannot be passed on\n";
+            return 1;
+        }
+        if (!daemon_protocol::requestFiles(options.daemon_socket, daemon_protocol::OP_COMPRESS, options.input_paths[0],
+                                           options.output_path, error)) {
+            std::cerr << "Error: " << error << '\n';
+            return 1;
+        }
+        std::cout << "File compression successful.\n";
+        return 0;
+    }
+
+    if (options.train_dictionary) {
+        try {
+            std::vector<mtc::Buffer> samples = sampleChunks(options.input_paths, options.engine.chunk_size);
+            mtc::Buffer dictionary = mtc::trainDictionary(samples);
+            if (dictionary.empty()) {
+                std::cerr << "Error: The inputs have no repeated content to train a dictionary on\n";
+                return 1;
             }
-            try {
-                task();
-            } catch (const std::exception& e) {
-                std::cerr << "Exception caught in worker thread: " << e.what() << '\n';
+            std::ofstream out(options.output_path, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(dictionary.data()), dictionary.size());
+            out.close();
+            if (!out) {
+                std::cerr << "Error: Could not write dictionary " << options.output_path << "\n";
+                return 1;
             }
+            std::cout << "Trained a " << dictionary.size() << "-byte dictionary on " << samples.size() << " sample chunks.\n";
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << '\n';
+            return 1;
         }
+        return 0;
     }
-};
 
-// Compresses a vector of data using zlib.
-std::vector<unsigned char> compressData(const std::vector<unsigned char>& input) {
-    if (input.empty()) {
-        return {};
+    // With --stats=json stdout carries nothing but the JSON report.
+    std::ostream null_stream(nullptr);
+    std::ostream& console = options.stats == "json" ? null_stream : std::cout;
+    if (!options.trace_path.empty()) {
+        Tracer::instance().start();
+        Tracer::instance().nameCurrentThread("reader/writer");
     }
-    // Calculate the upper bound for the compressed data size.
-    uLongf compressedSize = compressBound(input.size());
-    std::vector<unsigned char> output(compressedSize);
 
-    // Perform compression.
-    if (compress(output.data(), &compressedSize, input.data(), input.size()) != Z_OK) {
-        throw std::runtime_error("Compression failed");
+    // Open input file for reading in binary mode. Archives open their files as they go.
+    std::ifstream in;
+    if (!options.archive) {
+        in.open(options.input_paths[0], std::ios::binary);
+        if (!in) {
+            std::cerr << "Error: Could not open input file " << options.input_paths[0] << "\n";
+            return 1;
+        }
     }
 
-    // Resize the output vector to the actual compressed size.
-    output.resize(compressedSize);
-    return output;
-}
-
-int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <input_file> <output_file>\n";
+    if (options.archive && !options.base_path.empty()) {
+        std::cerr << "Error: --base applies to single files, not archives\n";
         return 1;
     }
 
-    // Open input file for reading in binary mode.
-    std::ifstream in(argv[1], std::ios::binary);
-    if (!in) {
-        std::cerr << "Error: Could not open input file " << argv[1] << "\n";
-        return 1;
+    // Open output file for writing in binary mode. With --base the library
+    // opens it itself, to copy chunks from the base straight into it.
+    std::ofstream out;
+    if (options.base_path.empty()) {
+        out.open(options.output_path, std::ios::binary);
+        if (!out) {
+            std::cerr << "Error: Could not open output file " << options.output_path << "\n";
+            return 1;
+        }
     }
 
-    // Open output file for writing in binary mode.
-    std::ofstream out(argv[2], std::ios::binary);
-    if (!out) {
-        std::cerr << "Error: Could not open output file " << argv[2] << "\n";
-        return 1;
+    // Workers report compressed input bytes; declared before the engine so it outlives the workers.
+    std::unique_ptr<ProgressReporter> progress;
+    if (options.progress) {
+        progress = std::make_unique<ProgressReporter>(totalInputBytes(options.input_paths));
     }
 
-    // --- Phase 1: Read the entire file into chunks ---
-    std::vector<Chunk> chunks;
-    size_t id_counter = 0;
-    // Use a more robust loop for reading the file.
-    std::vector<unsigned char> buffer(CHUNK_SIZE);
-    while (in.read(reinterpret_cast<char*>(buffer.data()), CHUNK_SIZE)) {
-        chunks.push_back({id_counter++, std::vector<unsigned char>(buffer.begin(), buffer.end())});
-    }
-    // Handle the last, potentially smaller, chunk.
-    if (in.gcount() > 0) {
-        buffer.resize(in.gcount());
-        chunks.push_back({id_counter++, std::move(buffer)});
+    RunStats stats;
+    try {
+        mtc::Compressor compressor(options.engine);
+        if (options.engine.numa && compressor.numaNodes() < 2) {
+            console << "Only one NUMA node found; running without NUMA placement.\n";
+        }
+        console << "Using " << compressor.threads() << " worker threads.\n";
+        if (options.engine.huge_pages) {
+            console << "Chunk buffers backed by " << pageBackingName(compressor.pageBacking()) << " memory.\n";
+        }
+        if (compressor.numaNodes() > 1) {
+            console << "Using " << compressor.numaNodes() << " NUMA nodes.\n";
+        }
+
+        console << "Compressing chunks...\n";
+        if (progress) {
+            progress->start();
+        }
+        if (options.archive) {
+            compressor.compressFiles(options.input_paths, out, &stats, progress.get());
+        } else if (!options.base_path.empty()) {
+            compressor.compressIncremental(in, options.output_path, options.base_path, &stats, progress.get());
+        } else {
+            compressor.compress(in, out, &stats, progress.get());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
     }
     in.close();
-
-    if (chunks.empty()) {
-        std::cout << "Input file is empty. Nothing to compress.\n";
-        return 0;
+    if (progress) {
+        progress->stop();
     }
-
-    std::cout << "Read " << chunks.size() << " chunks from the input file.\n";
-
-    // --- Phase 2: Compress all chunks in parallel ---
-    ThreadPool pool(std::thread::hardware_concurrency());
-    std::vector<CompressedChunk> compressed_chunks;
-    std::mutex results_mutex;
-
-    for (const auto& chunk : chunks) {
-        pool.enqueue([&results_mutex, &compressed_chunks, chunk] {
-            auto compressed_data = compressData(chunk.data);
-            
-            // Lock the mutex to safely add the result to the shared vector.
-            std::lock_guard<std::mutex> lock(results_mutex);
-            compressed_chunks.push_back({chunk.id, std::move(compressed_data)});
-        });
+    // Closing writes out whatever the stream still buffers. With --base the
+    // library wrote the output itself and `out` was never opened.
+    if (out.is_open()) {
+        out.close();
+        if (!out) {
+            std::cerr << "Error: Could not write output file " << options.output_path << "\n";
+            return 1;
+        }
     }
 
-    // Shutdown the pool. This call will block until all enqueued compression tasks are complete.
-    // This is the main synchronization point that fixes the deadlock.
-    std::cout << "Compressing chunks...\n";
-    pool.shutdown();
-    std::cout << "Compression complete.\n";
-
-    // --- Phase 3: Sort and write the compressed chunks ---
-    std::cout << "Sorting compressed chunks...\n";
-    std::sort(compressed_chunks.begin(), compressed_chunks.end(), 
-              [](const CompressedChunk& a, const CompressedChunk& b) {
-        return a.id < b.id;
-    });
+    if (stats.chunks == 0 && !options.archive) {
+        console << "Input file is empty. Nothing to compress.\n";
+    } else {
+        console << "Compressed " << stats.chunks << " chunks";
+        if (stats.duplicate_chunks) {
+            console << ", " << stats.duplicate_chunks << " of them duplicates";
+        }
+        if (stats.reused_chunks) {
+            console << ", " << stats.reused_chunks << " copied from the base";
+        }
+        console << ".\n";
+        console << "File compression successful.\n";
+    }
 
-    std::cout << "Writing to output file...\n";
-    for (const auto& compressed_chunk : compressed_chunks) {
-        // We also need to write the size of the chunk so we can decompress it later.
-        uint32_t size = compressed_chunk.data.size();
-        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
-        out.write(reinterpret_cast<const char*>(compressed_chunk.data.data()), size);
+    if (!options.trace_path.empty() && !Tracer::instance().writeJson(options.trace_path)) {
+        std::cerr << "Error: Could not write trace file " << options.trace_path << "\n";
+        return 1;
     }
-    out.close();
 
-    std::cout << "File compression successful.\n";
+    if (options.stats == "json") {
+        stats.writeJson(std::cout);
+    } else if (options.stats == "text") {
+        stats.writeText(std::cout);
+    }
 
     return 0;
 }
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>             // For std::memset
+#include <linux/perf_event.h>  // For perf_event_attr
+#include <sys/ioctl.h>         // For ioctl
+#include <sys/syscall.h>       // For SYS_perf_event_open
+#include <unistd.h>            // For syscall, read, close
+
+// Hardware counter totals for a span of work.
+struct CounterValues {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t llc_misses = 0; // PERF_COUNT_HW_CACHE_MISSES, which counts last-level cache misses.
+    uint64_t branch_misses = 0;
+
+    CounterValues& operator+=(const CounterValues& other) {
+        cycles += other.cycles;
+        instructions += other.instructions;
+        llc_misses += other.llc_misses;
+        branch_misses += other.branch_misses;
+        return *this;
+    }
+
+    CounterValues operator-(const CounterValues& other) const {
+        return {cycles - other.cycles, instructions - other.instructions, llc_misses - other.llc_misses,
+                branch_misses - other.branch_misses};
+    }
+
+    double ipc() const { return cycles ? static_cast<double>(instructions) / cycles : 0; }
+};
+
+// A perf_event_open counter group measuring the calling thread in user space.
+// Construct it on the thread to be measured and read() before and after the work.
+// When the kernel refuses (no PMU, perf_event_paranoid, seccomp) available() is
+// false and read() returns zeros, so callers need no special casing.
+class PerfCounters {
+public:
+    PerfCounters() {
+        const uint64_t configs[COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                         PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < COUNT; ++i) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = i == 0; // The leader starts the whole group.
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0));
+            if (fds[i] < 0) {
+                close();
+                return;
+            }
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    ~PerfCounters() { close(); }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return fds[0] >= 0; }
+
+    // Returns the running totals since construction.
+    CounterValues read() const {
+        CounterValues values;
+        if (!available()) {
+            return values;
+        }
+        // PERF_FORMAT_GROUP layout: number of events, then one value per event.
+        uint64_t data[1 + COUNT] = {};
+        if (::read(fds[0], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[0] != COUNT) {
+            return values;
+        }
+        values.cycles = data[1];
+        values.instructions = data[2];
+        values.llc_misses = data[3];
+        values.branch_misses = data[4];
+        return values;
+    }
+
+private:
+    static constexpr int COUNT = 4;
+    int fds[COUNT] = {-1, -1, -1, -1};
+
+    void close() {
+        for (int& fd : fds) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+    }
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>   // For std::fprintf
+#include <algorithm> // For std::min
+#include <mutex>
+#include <thread>
+#include <unistd.h> // For isatty
+
+// Prints bytes processed, instantaneous MB/s and an ETA to stderr from a sampler thread.
+// Producers only bump an atomic counter, so the hot path pays one relaxed add per chunk.
+class ProgressReporter {
+public:
+    // `total_bytes` may be 0 when the input size is unknown; percentage and ETA are then omitted.
+    ProgressReporter(uint64_t total_bytes, std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+        : total(total_bytes), interval(interval) {}
+
+    ~ProgressReporter() { stop(); }
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    // Whether progress should be shown by default: only when stderr is an interactive terminal.
+    static bool defaultEnabled() { return isatty(STDERR_FILENO); }
+
+    void add(uint64_t bytes) { done.fetch_add(bytes, std::memory_order_relaxed); }
+
+    void start() {
+        start_time = std::chrono::steady_clock::now();
+        sampler = std::thread([this] { this->run(); });
+    }
+
+    // Stops the sampler and prints a final line.
+    void stop() {
+        if (!sampler.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex);
+            stopping = true;
+        }
+        stop_signal.notify_all();
+        sampler.join();
+        std::fprintf(stderr, "\n");
+    }
+
+private:
+    void run() {
+        uint64_t last_bytes = 0;
+        auto last_time = start_time;
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        while (true) {
+            bool finished = stop_signal.wait_for(lock, interval, [this] { return stopping; });
+            auto now = std::chrono::steady_clock::now();
+            uint64_t bytes = done.load(std::memory_order_relaxed);
+            double window = std::chrono::duration<double>(now - last_time).count();
+            double elapsed = std::chrono::duration<double>(now - start_time).count();
+            double mbps = window > 0 ? (bytes - last_bytes) / (1024.0 * 1024.0) / window : 0;
+            if (finished) {
+                // The final line reports the average over the whole run.
+                mbps = elapsed > 0 ? bytes / (1024.0 * 1024.0) / elapsed : 0;
+            }
+            print(bytes, mbps, elapsed);
+            if (finished) {
+                return;
+            }
+            last_bytes = bytes;
+            last_time = now;
+        }
+    }
+
+    void print(uint64_t bytes, double mbps, double elapsed) const {
+        double mb = bytes / (1024.0 * 1024.0);
+        if (total == 0) {
+            std::fprintf(stderr, "\r%.1f MB  %.1f MB/s  %.0fs elapsed   ", mb, mbps, elapsed);
+            return;
+        }
+        double percent = 100.0 * bytes / total;
+        // The ETA uses the average rate so it does not jump with every sample.
+        double average = elapsed > 0 ? bytes / elapsed : 0;
+        long long eta = average > 0 ? static_cast<long long>((total - std::min(bytes, total)) / average) : -1;
+        if (eta >= 0) {
+            std::fprintf(stderr, "\r%5.1f%%  %.1f / %.1f MB  %.1f MB/s  ETA %lld:%02lld:%02lld   ", percent, mb,
+                         total / (1024.0 * 1024.0), mbps, eta / 3600, eta / 60 % 60, eta % 60);
+        } else {
+            std::fprintf(stderr, "\r%5.1f%%  %.1f / %.1f MB  %.1f MB/s  ETA --:--:--   ", percent, mb,
+                         total / (1024.0 * 1024.0), mbps);
+        }
+    }
+
+    const uint64_t total;
+    const std::chrono::milliseconds interval;
+    std::atomic<uint64_t> done{0};
+    std::chrono::steady_clock::time_point start_time;
+    std::thread sampler;
+    std::mutex stop_mutex;
+    std::condition_variable stop_signal;
+    bool stopping = false;
+};
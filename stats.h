@@ -0,0 +1,200 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm> // For std::sort
+#include "perf_counters.h"
+#include "alloc_tracker.h"
+
+// Timing and throughput counters for one compressor or decompressor run,
+// reported with --stats=text or --stats=json.
+
+using Clock = std::chrono::steady_clock;
+
+inline double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Time spent in one phase of the pipeline and the bytes it handled.
+struct PhaseStats {
+    std::string name;
+    double seconds = 0;
+    uint64_t bytes = 0;
+    int index = 0; // Allocation tracking slot; 0 is reserved for work outside any phase.
+
+    double mbps() const { return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0; }
+};
+
+// Adds the time between construction and destruction to a phase, and in the
+// allocation tracking build charges the thread's allocations to it as well.
+class ScopedPhase {
+public:
+    explicit ScopedPhase(PhaseStats& phase) : phase(phase), alloc_scope(phase.index), start(Clock::now()) {}
+    ~ScopedPhase() { phase.seconds += secondsSince(start); }
+
+private:
+    PhaseStats& phase;
+    AllocPhaseScope alloc_scope;
+    Clock::time_point start;
+};
+
+struct RunStats {
+    std::string tool;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    size_t chunks = 0;
+    size_t duplicate_chunks = 0;       // Chunks stored as references to an identical earlier one.
+    size_t reused_chunks = 0;          // Chunks copied from a base container instead of compressed.
+    std::vector<size_t> level_chunks;  // With a throughput target: chunks compressed at each level 0-9.
+    size_t threads = 0;
+    double wall_seconds = 0;
+    double worker_busy_seconds = 0;    // Summed over all workers.
+    std::deque<PhaseStats> phases;     // A deque so references from phase() stay valid.
+    std::vector<double> chunk_seconds; // Per-chunk (de)compression latency.
+
+    // Hardware counters summed over every worker's compressData/decompressData calls.
+    bool perf_enabled = false;
+    bool perf_available = false;
+    CounterValues counters;
+    uint64_t counted_bytes = 0; // Uncompressed bytes covered by the counters.
+
+    // Returns the named phase, adding it on first use so phases keep pipeline order.
+    PhaseStats& phase(const std::string& name) {
+        for (auto& p : phases)
+            if (p.name == name) return p;
+        phases.push_back({name});
+        phases.back().index = static_cast<int>(phases.size()) % alloc_tracking::MAX_PHASES;
+        return phases.back();
+    }
+
+    // Fraction of the run the workers spent doing work rather than waiting.
+    double workerUtilization() const {
+        return threads && wall_seconds > 0 ? worker_busy_seconds / (threads * wall_seconds) : 0;
+    }
+
+    // Returns the q-th quantile (0..1) of the per-chunk latencies in seconds.
+    double latencyQuantile(double q) const {
+        if (chunk_seconds.empty()) {
+            return 0;
+        }
+        std::vector<double> sorted = chunk_seconds;
+        std::sort(sorted.begin(), sorted.end());
+        size_t index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+        return sorted[index];
+    }
+
+    static uint64_t totalAllocations() {
+        uint64_t total = 0;
+        for (const auto& counters : alloc_tracking::phase_counters)
+            total += counters.allocations.load();
+        return total;
+    }
+
+    // Allocations outside any named phase: setup, teardown and dispatch.
+    static uint64_t setupAllocations() {
+        return alloc_tracking::phase_counters[0].allocations.load();
+    }
+
+    static void writeAllocPhaseJson(std::ostream& out, const std::string& name, int index) {
+        const auto& counters = alloc_tracking::phase_counters[index];
+        out << "\"" << name << "\": {\"allocations\": " << counters.allocations.load()
+            << ", \"bytes\": " << counters.bytes.load() << ", \"peak_rss_kb\": " << counters.peak_rss_kb.load() << "}";
+    }
+
+    static void writeAllocPhaseText(std::ostream& out, const std::string& name, int index) {
+        const auto& counters = alloc_tracking::phase_counters[index];
+        out << "    " << std::left << std::setw(12) << name << std::right << std::setw(10)
+            << counters.allocations.load() << " allocs " << std::setw(14) << counters.bytes.load() << " bytes\n";
+    }
+
+    double cyclesPerByte() const {
+        return counted_bytes ? static_cast<double>(counters.cycles) / counted_bytes : 0;
+    }
+
+    void writeJson(std::ostream& out) const {
+        out << std::fixed << std::setprecision(6);
+        out << "{\"tool\": \"" << tool << "\", \"bytes_in\": " << bytes_in << ", \"bytes_out\": " << bytes_out
+            << ", \"chunks\": " << chunks << ", \"duplicate_chunks\": " << duplicate_chunks
+            << ", \"reused_chunks\": " << reused_chunks;
+        if (!level_chunks.empty()) {
+            out << ", \"level_chunks\": [";
+            for (size_t i = 0; i < level_chunks.size(); ++i)
+                out << (i ? ", " : "") << level_chunks[i];
+            out << "]";
+        }
+        out << ", \"threads\": " << threads
+            << ", \"wall_seconds\": " << wall_seconds
+            << ", \"mbps\": " << (wall_seconds > 0 ? bytes_in / (1024.0 * 1024.0) / wall_seconds : 0)
+            << ", \"phases\": {";
+        for (size_t i = 0; i < phases.size(); ++i) {
+            out << (i ? ", " : "") << "\"" << phases[i].name << "\": {\"seconds\": " << phases[i].seconds
+                << ", \"bytes\": " << phases[i].bytes << ", \"mbps\": " << phases[i].mbps() << "}";
+        }
+        out << "}, \"chunk_latency_ms\": {\"p50\": " << latencyQuantile(0.50) * 1000
+            << ", \"p99\": " << latencyQuantile(0.99) * 1000
+            << ", \"max\": " << latencyQuantile(1.0) * 1000 << "}"
+            << ", \"worker_utilization\": " << workerUtilization();
+        if (perf_enabled) {
+            out << ", \"perf\": {\"available\": " << (perf_available ? "true" : "false")
+                << ", \"cycles\": " << counters.cycles << ", \"instructions\": " << counters.instructions
+                << ", \"llc_misses\": " << counters.llc_misses << ", \"branch_misses\": " << counters.branch_misses
+                << ", \"ipc\": " << counters.ipc() << ", \"cycles_per_byte\": " << cyclesPerByte() << "}";
+        }
+        if (alloc_tracking::enabled()) {
+            out << ", \"alloc\": {\"phases\": {";
+            writeAllocPhaseJson(out, "other", 0);
+            for (const auto& p : phases) {
+                out << ", ";
+                writeAllocPhaseJson(out, p.name, p.index);
+            }
+            out << "}, \"allocations\": " << totalAllocations() << ", \"allocations_per_chunk\": "
+                << (chunks ? static_cast<double>(totalAllocations() - setupAllocations()) / chunks : 0)
+                << ", \"peak_heap_bytes\": " << alloc_tracking::peak_live_bytes.load()
+                << ", \"peak_rss_kb\": " << alloc_tracking::peakRssKb() << "}";
+        }
+        out << "}\n";
+    }
+
+    void writeText(std::ostream& out) const {
+        out << std::fixed << std::setprecision(3);
+        out << "Stats: " << bytes_in << " bytes in, " << bytes_out << " bytes out, " << chunks << " chunks, "
+            << threads << " threads, " << wall_seconds << " s\n";
+        if (duplicate_chunks) {
+            out << "  " << duplicate_chunks << " duplicate chunks stored as references\n";
+        }
+        if (reused_chunks) {
+            out << "  " << reused_chunks << " chunks copied from the base\n";
+        }
+        if (!level_chunks.empty()) {
+            out << "  chunks per level:";
+            for (size_t i = 0; i < level_chunks.size(); ++i)
+                if (level_chunks[i]) out << ' ' << i << ':' << level_chunks[i];
+            out << '\n';
+        }
+        for (const auto& p : phases) {
+            out << "  " << std::left << std::setw(12) << p.name << std::right << std::setw(10) << p.seconds
+                << " s " << std::setw(10) << p.mbps() << " MB/s\n";
+        }
+        out << "  chunk latency p50 " << latencyQuantile(0.50) * 1000 << " ms, p99 "
+            << latencyQuantile(0.99) * 1000 << " ms\n"
+            << "  worker utilization " << workerUtilization() * 100 << "%\n";
+        if (perf_enabled && !perf_available) {
+            out << "  hardware counters unavailable (perf_event_open failed)\n";
+        } else if (perf_enabled) {
+            out << "  IPC " << counters.ipc() << ", " << cyclesPerByte() << " cycles/byte, "
+                << counters.llc_misses << " LLC misses, " << counters.branch_misses << " branch misses\n";
+        }
+        if (alloc_tracking::enabled()) {
+            out << "  heap: " << totalAllocations() << " allocations, peak " << alloc_tracking::peak_live_bytes.load()
+                << " bytes live, peak RSS " << alloc_tracking::peakRssKb() << " KB\n";
+            writeAllocPhaseText(out, "other", 0);
+            for (const auto& p : phases)
+                writeAllocPhaseText(out, p.name, p.index);
+        }
+    }
+};
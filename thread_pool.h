@@ -0,0 +1,274 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <functional>
+#include <future>
+#include <type_traits> // For std::invoke_result_t
+#include <utility>     // For std::pair
+#include <memory>    // For std::shared_ptr
+#include <stdexcept> // For std::runtime_error
+#include "topology.h"
+#include "trace.h"
+
+class TaskGroup;
+
+// A simple and robust thread pool implementation.
+//
+// Tasks are queued per job. Plain enqueue() uses the pool's default job and a
+// TaskGroup is a job of its own; workers take one task at a time from each job
+// with work in turn, so a long job cannot starve the ones queued behind it.
+class ThreadPool {
+public:
+    // Constructor: creates a specified number of worker threads.
+    // If `cpus` is non-empty every worker is pinned to that CPU set.
+    ThreadPool(size_t n, std::vector<int> cpus = {})
+        : default_job(std::make_shared<JobQueue>()), stop(false), cpus(std::move(cpus)) {
+        for (size_t i = 0; i < n; ++i)
+            workers.emplace_back([this, i]() { this->worker_thread(i); });
+    }
+
+    // Destructor: ensures the thread pool is shut down properly.
+    ~ThreadPool() {
+        shutdown();
+    }
+
+    // Enqueues a new task for the workers to execute.
+    void enqueue(std::function<void()> task) {
+        enqueue(default_job, std::move(task));
+    }
+
+    // Runs `task` on a worker and returns a future for its result. An exception
+    // thrown by the task is rethrown by get(); a task dropped because the pool
+    // is stopping reports std::future_error (broken promise).
+    template <typename F>
+    std::future<std::invoke_result_t<F&>> submit(F task) {
+        auto [wrapped, result] = package(std::move(task));
+        enqueue(default_job, std::move(wrapped));
+        return std::move(result);
+    }
+
+    // Submits several tasks under one lock acquisition. The futures are in task order.
+    template <typename F>
+    std::vector<std::future<std::invoke_result_t<F&>>> submitBatch(std::vector<F> tasks) {
+        auto [wrapped, results] = packageAll(std::move(tasks));
+        enqueueBatch(default_job, std::move(wrapped));
+        return std::move(results);
+    }
+
+    // Shuts down the thread pool, waiting for all tasks to complete.
+    void shutdown() {
+        if (stop) return; // Already shutting down
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for (auto& worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+
+private:
+    friend class TaskGroup;
+
+    // Pending tasks of one job. `scheduled` is true while the job sits in `ready`.
+    struct JobQueue {
+        std::queue<std::function<void()>> tasks;
+        bool scheduled = false;
+        std::function<void()> task_done; // If set, runs after each task, even one that threw.
+    };
+
+    std::vector<std::thread> workers;
+    std::shared_ptr<JobQueue> default_job;
+    std::deque<std::shared_ptr<JobQueue>> ready; // Jobs with queued tasks, in round-robin order.
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop;
+    const std::vector<int> cpus;
+
+    // Returns false, dropping the task, if the pool is stopping.
+    bool enqueue(const std::shared_ptr<JobQueue>& job, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (stop) {
+                // Do not enqueue new tasks if the pool is stopping.
+                return false;
+            }
+            job->tasks.push(std::move(task));
+            if (!job->scheduled) {
+                job->scheduled = true;
+                ready.push_back(job);
+            }
+        }
+        condition.notify_one();
+        return true;
+    }
+
+    // Adds several tasks to a job at once and wakes enough workers for them.
+    bool enqueueBatch(const std::shared_ptr<JobQueue>& job, std::vector<std::function<void()>> batch) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (stop) {
+                return false;
+            }
+            for (auto& task : batch)
+                job->tasks.push(std::move(task));
+            if (!job->scheduled && !job->tasks.empty()) {
+                job->scheduled = true;
+                ready.push_back(job);
+            }
+        }
+        condition.notify_all();
+        return true;
+    }
+
+    // Wraps a callable so the queue can run it and the caller can collect its
+    // result. std::function needs a copyable target, so the packaged_task, which
+    // may hold move-only captures, lives behind a shared_ptr.
+    template <typename F>
+    static std::pair<std::function<void()>, std::future<std::invoke_result_t<F&>>> package(F task) {
+        using Result = std::invoke_result_t<F&>;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+        std::future<Result> result = packaged->get_future();
+        return {[packaged] { (*packaged)(); }, std::move(result)};
+    }
+
+    template <typename F>
+    static std::pair<std::vector<std::function<void()>>, std::vector<std::future<std::invoke_result_t<F&>>>>
+    packageAll(std::vector<F> tasks) {
+        std::vector<std::function<void()>> wrapped;
+        std::vector<std::future<std::invoke_result_t<F&>>> results;
+        wrapped.reserve(tasks.size());
+        results.reserve(tasks.size());
+        for (auto& task : tasks) {
+            auto [function, result] = package(std::move(task));
+            wrapped.push_back(std::move(function));
+            results.push_back(std::move(result));
+        }
+        return {std::move(wrapped), std::move(results)};
+    }
+
+    // The main loop for each worker thread.
+    void worker_thread(size_t index) {
+        if (!pinCurrentThread(cpus)) {
+            std::cerr << "Warning: could not set worker CPU affinity\n";
+        }
+        Tracer::instance().nameCurrentThread("worker " + std::to_string(index));
+        while (true) {
+            std::function<void()> task;
+            std::shared_ptr<JobQueue> job;
+            {
+                // Covers both contention on queue_mutex and idling for work.
+                TraceScope trace("queue wait", "pool");
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                condition.wait(lock, [this] { return this->stop || !this->ready.empty(); });
+                if (this->stop && this->ready.empty()) {
+                    return;
+                }
+                // Take one task from the job at the front, then send the job to the
+                // back of the line if it has more.
+                job = ready.front();
+                ready.pop_front();
+                task = std::move(job->tasks.front());
+                job->tasks.pop();
+                if (job->tasks.empty()) {
+                    job->scheduled = false;
+                } else {
+                    ready.push_back(job);
+                }
+            }
+            try {
+                TraceScope trace("task", "pool");
+                task();
+            } catch (const std::exception& e) {
+                std::cerr << "Exception caught in worker thread: " << e.what() << '\n';
+            }
+            // Release the task's captures before reporting it done.
+            task = nullptr;
+            if (job->task_done) {
+                job->task_done();
+            }
+        }
+    }
+};
+
+// A job on a shared ThreadPool: its tasks are scheduled fairly against other
+// jobs' tasks, and wait() blocks until every task run() so far has finished.
+// The destructor waits too, so tasks never outlive the state they capture.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool), job(std::make_shared<ThreadPool::JobQueue>()) {
+        job->task_done = [this] { finishOne(); };
+    }
+
+    ~TaskGroup() { wait(); }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++outstanding;
+        }
+        if (!pool.enqueue(job, std::move(task))) {
+            finishOne();
+            throw std::runtime_error("ThreadPool is shutting down");
+        }
+    }
+
+    // As ThreadPool::submit, but as part of this group.
+    template <typename F>
+    std::future<std::invoke_result_t<F&>> submit(F task) {
+        auto [wrapped, result] = ThreadPool::package(std::move(task));
+        run(std::move(wrapped));
+        return std::move(result);
+    }
+
+    // As ThreadPool::submitBatch, but as part of this group.
+    template <typename F>
+    std::vector<std::future<std::invoke_result_t<F&>>> submitBatch(std::vector<F> tasks) {
+        auto [wrapped, results] = ThreadPool::packageAll(std::move(tasks));
+        size_t count = wrapped.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            outstanding += count;
+        }
+        if (!pool.enqueueBatch(job, std::move(wrapped))) {
+            for (size_t i = 0; i < count; ++i)
+                finishOne();
+            throw std::runtime_error("ThreadPool is shutting down");
+        }
+        return std::move(results);
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return outstanding == 0; });
+    }
+
+private:
+    ThreadPool& pool;
+    std::shared_ptr<ThreadPool::JobQueue> job;
+    std::mutex mutex;
+    std::condition_variable idle;
+    size_t outstanding = 0;
+
+    void finishOne() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--outstanding == 0) {
+            idle.notify_all();
+        }
+    }
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm> // For std::min, std::find
+#include <cmath>     // For std::ceil
+#include <stdexcept> // For std::invalid_argument
+#include <pthread.h> // For pthread_setaffinity_np
+#include <sched.h>   // For cpu_set_t
+
+// Parses a Linux CPU list such as "0-3,8,10-11" into individual ids. Throws
+// std::invalid_argument for ids a cpu_set_t cannot hold and reversed ranges.
+inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        if (first < 0 || last >= CPU_SETSIZE || first > last) {
+            throw std::invalid_argument("Bad CPU range " + range);
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Returns the CPUs of each online NUMA node. Nodes without CPUs (memory-only nodes)
+// are skipped. Returns an empty vector when sysfs has no NUMA information.
+inline std::vector<std::vector<int>> numaNodeCpus() {
+    std::vector<std::vector<int>> nodes;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string node_list;
+    if (!online || !std::getline(online, node_list)) {
+        return nodes;
+    }
+    for (int node : parseCpuList(node_list)) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (file && std::getline(file, list)) {
+            std::vector<int> cpus = parseCpuList(list);
+            if (!cpus.empty()) {
+                nodes.push_back(std::move(cpus));
+            }
+        }
+    }
+    return nodes;
+}
+
+// Returns the CPUs this process may run on, as set by taskset, cpusets or a container runtime.
+inline std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Returns the CPUs of `requested` this process may run on, each once and in
+// ascending order. Empty if it may run on none of them.
+inline std::vector<int> allowedSubset(const std::vector<int>& requested) {
+    std::vector<int> usable;
+    for (int cpu : allowedCpus())
+        if (std::find(requested.begin(), requested.end(), cpu) != requested.end()) usable.push_back(cpu);
+    return usable;
+}
+
+// Reads "<quota> <period>" style limits and returns quota / period, or 0 if unlimited.
+inline double readCpuQuota(const std::string& quota_path, const std::string& period_path = "") {
+    std::ifstream quota_file(quota_path);
+    std::string quota;
+    long long period = 0;
+    if (!(quota_file >> quota)) {
+        return 0;
+    }
+    if (period_path.empty()) {
+        quota_file >> period; // cgroup v2 keeps both values in cpu.max.
+    } else {
+        std::ifstream period_file(period_path);
+        period_file >> period;
+    }
+    if (quota == "max" || quota == "-1" || period <= 0) {
+        return 0;
+    }
+    return std::stoll(quota) / static_cast<double>(period);
+}
+
+// Returns the CPU bandwidth limit of this process's cgroup in CPUs (e.g. 2.5),
+// or 0 when no quota is set. Supports both cgroup v2 and the v1 cpu controller.
+inline double cgroupCpuLimit() {
+    // /proc/self/cgroup lines look like "0::/path" (v2) or "4:cpu,cpuacct:/path" (v1).
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroups, line)) {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) {
+            continue;
+        }
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        if (controllers.empty()) {
+            double limit = readCpuQuota("/sys/fs/cgroup" + path + "/cpu.max");
+            if (limit > 0) return limit;
+        } else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+            for (std::string mount : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+                double limit = readCpuQuota(mount + path + "/cpu.cfs_quota_us", mount + path + "/cpu.cfs_period_us");
+                if (limit > 0) return limit;
+            }
+        }
+    }
+    // Inside a container the cgroup is usually mounted as the root of the hierarchy.
+    double limit = readCpuQuota("/sys/fs/cgroup/cpu.max");
+    if (limit > 0) return limit;
+    return readCpuQuota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+}
+
+// Picks a worker count for the given CPU set: one per CPU, capped by the cgroup quota
+// so a container limited to 4 CPUs does not spawn a thread per host core.
+inline size_t defaultThreadCount(const std::vector<int>& cpus) {
+    size_t threads = cpus.empty() ? std::thread::hardware_concurrency() : cpus.size();
+    double limit = cgroupCpuLimit();
+    if (limit > 0) {
+        threads = std::min(threads, static_cast<size_t>(std::ceil(limit)));
+    }
+    return std::max<size_t>(1, threads);
+}
+
+// Restricts the calling thread to the given CPUs. An empty list leaves it unpinned.
+inline bool pinCurrentThread(const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Runs a function on a temporary thread pinned to the given CPUs and waits for it.
+// Used to first-touch memory so the kernel places its pages on the CPUs' NUMA node.
+inline void runOnCpus(const std::vector<int>& cpus, const std::function<void()>& fn) {
+    std::thread thread([&cpus, &fn] {
+        pinCurrentThread(cpus);
+        fn();
+    });
+    thread.join();
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records pipeline activity as Chrome trace events ("X" complete events plus
+// thread-name metadata) so a run can be opened in Perfetto or chrome://tracing.
+// Tracing is off unless start() is called; disabled scopes cost one atomic load.
+class Tracer {
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void start() {
+        origin = std::chrono::steady_clock::now();
+        active.store(true, std::memory_order_release);
+    }
+
+    bool enabled() const { return active.load(std::memory_order_acquire); }
+
+    // Labels the calling thread in the trace viewer.
+    void nameCurrentThread(const std::string& name) {
+        if (!enabled()) return;
+        std::lock_guard<std::mutex> lock(events_mutex);
+        thread_names.push_back({threadId(), name});
+    }
+
+    // Records a span on the calling thread. `arg` is attached as args.chunk when non-negative.
+    void complete(const char* name, const char* category, std::chrono::steady_clock::time_point begin,
+                  std::chrono::steady_clock::time_point end, long long arg = -1) {
+        Event event{name, category, micros(begin), micros(end) - micros(begin), threadId(), arg};
+        std::lock_guard<std::mutex> lock(events_mutex);
+        events.push_back(event);
+    }
+
+    // Writes everything recorded so far in the Chrome trace JSON format.
+    bool writeJson(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(events_mutex);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (const auto& thread : thread_names) {
+            out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+                << thread.first << ", \"args\": {\"name\": \"" << thread.second << "\"}}";
+            first = false;
+        }
+        for (const auto& e : events) {
+            out << (first ? "" : ",\n") << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.tid << ", \"ts\": " << e.ts
+                << ", \"dur\": " << e.dur;
+            if (e.arg >= 0) {
+                out << ", \"args\": {\"chunk\": " << e.arg << "}";
+            }
+            out << "}";
+            first = false;
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    struct Event {
+        const char* name;
+        const char* category;
+        long long ts;  // Microseconds since start().
+        long long dur; // Microseconds.
+        int tid;
+        long long arg;
+    };
+
+    Tracer() = default;
+
+    long long micros(std::chrono::steady_clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - origin).count();
+    }
+
+    // Small sequential ids read better in the viewer than native thread ids.
+    static int threadId() {
+        static std::atomic<int> next{1};
+        thread_local int id = next.fetch_add(1);
+        return id;
+    }
+
+    std::atomic<bool> active{false};
+    std::chrono::steady_clock::time_point origin;
+    std::mutex events_mutex;
+    std::vector<Event> events;
+    std::vector<std::pair<int, std::string>> thread_names;
+};
+
+// Records the lifetime of the scope as one trace span when tracing is enabled.
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* category, long long arg = -1)
+        : name(name), category(category), arg(arg), enabled(Tracer::instance().enabled()) {
+        if (enabled) begin = std::chrono::steady_clock::now();
+    }
+
+    ~TraceScope() {
+        if (enabled) Tracer::instance().complete(name, category, begin, std::chrono::steady_clock::now(), arg);
+    }
+
+private:
+    const char* name;
+    const char* category;
+    long long arg;
+    bool enabled;
+    std::chrono::steady_clock::time_point begin;
+};